@@ -2,6 +2,7 @@
 #include "hwacha_xcpt.h"
 #include "mmu.h"
 #include "trap.h"
+#include "checkpoint.h"
 #include <stdexcept>
 
 REGISTER_EXTENSION(hwacha, []() { return new hwacha_t; })
@@ -30,6 +31,14 @@ void hwacha_t::reset()
     ut_state[i].reset();
 }
 
+void hwacha_t::checkpoint(checkpoint_t& ckpt)
+{
+  ckpt.transfer(ct_state);
+  ckpt.transfer(ut_state);
+  ckpt.transfer(cause);
+  ckpt.transfer(aux);
+}
+
 static reg_t custom(processor_t* p, insn_t insn, reg_t pc)
 {
   require_accelerator;
@@ -35,6 +35,7 @@ public:
   const char* name() { return "hwacha"; }
   void reset();
   void set_debug(bool value) { debug = value; }
+  void checkpoint(checkpoint_t& ckpt);
 
   ct_state_t* get_ct_state() { return &ct_state; }
   ut_state_t* get_ut_state(int idx) { return &ut_state[idx]; }
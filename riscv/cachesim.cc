@@ -2,12 +2,18 @@
 
 #include "cachesim.h"
 #include "common.h"
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
 #include <cstdlib>
+#include <unistd.h>
 #include <iostream>
 #include <iomanip>
 
-cache_sim_t::cache_sim_t(size_t _sets, size_t _ways, size_t _linesz, const char* _name)
- : sets(_sets), ways(_ways), linesz(_linesz), name(_name)
+cache_sim_t::cache_sim_t(size_t _sets, size_t _ways, size_t _linesz, const char* _name,
+                         policy_t _policy)
+ : sets(_sets), ways(_ways), linesz(_linesz), policy(_policy), name(_name)
 {
   init();
 }
@@ -15,9 +21,11 @@ cache_sim_t::cache_sim_t(size_t _sets, size_t _ways, size_t _linesz, const char*
 static void help()
 {
   std::cerr << "Cache configurations must be of the form" << std::endl;
-  std::cerr << "  sets:ways:blocksize" << std::endl;
+  std::cerr << "  sets:ways:blocksize[:policy]" << std::endl;
   std::cerr << "where sets, ways, and blocksize are positive integers, with" << std::endl;
   std::cerr << "sets and blocksize both powers of two and blocksize at least 8." << std::endl;
+  std::cerr << "The replacement policy is one of random (the default), lru," << std::endl;
+  std::cerr << "plru (which needs a power-of-two number of ways), fifo, or rrip." << std::endl;
   exit(1);
 }
 
@@ -27,14 +35,29 @@ cache_sim_t* cache_sim_t::construct(const char* config, const char* name)
   if (!wp++) help();
   const char* bp = strchr(wp, ':');
   if (!bp++) help();
+  const char* pp = strchr(bp, ':');
 
   size_t sets = atoi(std::string(config, wp).c_str());
   size_t ways = atoi(std::string(wp, bp).c_str());
   size_t linesz = atoi(bp);
 
-  if (ways > 4 /* empirical */ && sets == 1)
-    return new fa_cache_sim_t(ways, linesz, name);
-  return new cache_sim_t(sets, ways, linesz, name);
+  policy_t policy = RANDOM;
+  if (pp++)
+  {
+    std::string p = pp;
+    if (p == "random") policy = RANDOM;
+    else if (p == "lru") policy = LRU;
+    else if (p == "plru") policy = PLRU;
+    else if (p == "fifo") policy = FIFO;
+    else if (p == "rrip") policy = RRIP;
+    else help();
+  }
+
+  // PLRU and RRIP need per-way state, so they keep the set-associative
+  // organization even when fully associative
+  if (ways > 4 /* empirical */ && sets == 1 && policy != PLRU && policy != RRIP)
+    return new fa_cache_sim_t(ways, linesz, name, policy);
+  return new cache_sim_t(sets, ways, linesz, name, policy);
 }
 
 void cache_sim_t::init()
@@ -43,12 +66,16 @@ void cache_sim_t::init()
     help();
   if(linesz < 8 || (linesz & (linesz-1)))
     help();
+  if(ways == 0 || (policy == PLRU && (ways & (ways-1))))
+    help();
 
   idx_shift = 0;
   for (size_t x = linesz; x>1; x >>= 1)
     idx_shift++;
 
   tags = new uint64_t[sets*ways]();
+  repl = new uint64_t[sets*ways]();
+  clock = 0;
   read_accesses = 0;
   read_misses = 0;
   bytes_read = 0;
@@ -56,22 +83,27 @@ void cache_sim_t::init()
   write_misses = 0;
   bytes_written = 0;
   writebacks = 0;
+  region_shift = 0;
 
   miss_handler = NULL;
 }
 
 cache_sim_t::cache_sim_t(const cache_sim_t& rhs)
  : sets(rhs.sets), ways(rhs.ways), linesz(rhs.linesz),
-   idx_shift(rhs.idx_shift), name(rhs.name)
+   idx_shift(rhs.idx_shift), policy(rhs.policy), clock(rhs.clock),
+   region_shift(rhs.region_shift), name(rhs.name)
 {
   tags = new uint64_t[sets*ways];
   memcpy(tags, rhs.tags, sets*ways*sizeof(uint64_t));
+  repl = new uint64_t[sets*ways];
+  memcpy(repl, rhs.repl, sets*ways*sizeof(uint64_t));
 }
 
 cache_sim_t::~cache_sim_t()
 {
   print_stats();
   delete [] tags;
+  delete [] repl;
 }
 
 void cache_sim_t::print_stats()
@@ -104,24 +136,119 @@ uint64_t* cache_sim_t::check_tag(uint64_t addr)
 {
   size_t idx = (addr >> idx_shift) & (sets-1);
   size_t tag = (addr >> idx_shift) | VALID;
+  uint64_t* set = &tags[idx*ways];
 
-  for (size_t i = 0; i < ways; i++)
-    if (tag == (tags[idx*ways + i] & ~DIRTY))
-      return &tags[idx*ways + i];
+  // compare four ways at a time without a branch per way, which lets the
+  // compiler vectorize the search of highly associative sets
+  size_t i = 0;
+  for (; i + 4 <= ways; i += 4)
+  {
+    unsigned match = ((set[i] & ~DIRTY) == tag) |
+                     ((set[i+1] & ~DIRTY) == tag) << 1 |
+                     ((set[i+2] & ~DIRTY) == tag) << 2 |
+                     ((set[i+3] & ~DIRTY) == tag) << 3;
+    if (match)
+      return &set[i + __builtin_ctz(match)];
+  }
+  for (; i < ways; i++)
+    if (tag == (set[i] & ~DIRTY))
+      return &set[i];
 
   return NULL;
 }
 
+size_t cache_sim_t::pick_victim(size_t idx)
+{
+  uint64_t* set = &tags[idx*ways];
+  uint64_t* state = &repl[idx*ways];
+
+  if (policy == RANDOM)
+    return lfsr.next() % ways;
+
+  for (size_t i = 0; i < ways; i++)
+    if (!(set[i] & VALID))
+      return i;
+
+  switch (policy)
+  {
+    case LRU:
+    case FIFO:
+      return std::min_element(state, state + ways) - state;
+    case PLRU:
+    {
+      // follow the tree towards the less recently used half
+      size_t node = 1;
+      while (node < ways)
+        node = 2*node + state[node];
+      return node - ways;
+    }
+    case RRIP:
+      while (true)
+      {
+        for (size_t i = 0; i < ways; i++)
+          if (state[i] == RRPV_MAX)
+            return i;
+        for (size_t i = 0; i < ways; i++)
+          state[i]++;
+      }
+    default:
+      abort();
+  }
+}
+
+void cache_sim_t::update(size_t idx, size_t way, bool fill)
+{
+  uint64_t* state = &repl[idx*ways];
+
+  switch (policy)
+  {
+    case LRU:
+      state[way] = ++clock;
+      break;
+    case FIFO:
+      if (fill)
+        state[way] = ++clock;
+      break;
+    case PLRU:
+    {
+      // point every node on the way's path away from it
+      size_t levels = __builtin_ctzl(ways);
+      for (size_t l = 0, node = 1; l < levels; l++)
+      {
+        size_t right = (way >> (levels - 1 - l)) & 1;
+        state[node] = !right;
+        node = 2*node + right;
+      }
+      break;
+    }
+    case RRIP:
+      // new lines are predicted to be re-referenced late, so lines used
+      // only once leave before those that have been reused
+      state[way] = fill ? RRPV_MAX - 1 : 0;
+      break;
+    default:
+      break;
+  }
+}
+
+void cache_sim_t::hit(uint64_t* line)
+{
+  size_t i = line - tags;
+  update(i / ways, i % ways, false);
+}
+
 uint64_t cache_sim_t::victimize(uint64_t addr)
 {
   size_t idx = (addr >> idx_shift) & (sets-1);
-  size_t way = lfsr.next() % ways;
+  size_t way = pick_victim(idx);
   uint64_t victim = tags[idx*ways + way];
   tags[idx*ways + way] = (addr >> idx_shift) | VALID;
+  update(idx, way, true);
   return victim;
 }
 
-void cache_sim_t::access(uint64_t addr, size_t bytes, bool store)
+bool cache_sim_t::access(uint64_t addr, size_t bytes, bool store, uint64_t pc,
+                         uint64_t* evicted)
 {
   store ? write_accesses++ : read_accesses++;
   (store ? bytes_written : bytes_read) += bytes;
@@ -131,49 +258,692 @@ void cache_sim_t::access(uint64_t addr, size_t bytes, bool store)
   {
     if (store)
       *hit_way |= DIRTY;
-    return;
+    if (policy != RANDOM)
+      hit(hit_way);
+    if (evicted)
+      *evicted = -1;
+    return true;
   }
 
   store ? write_misses++ : read_misses++;
+  if (unlikely(region_shift))
+  {
+    miss_count_t& by_pc = pc_misses[pc];
+    miss_count_t& by_region = region_misses[addr >> region_shift];
+    store ? by_pc.write_misses++ : by_pc.read_misses++;
+    store ? by_region.write_misses++ : by_region.read_misses++;
+  }
 
   uint64_t victim = victimize(addr);
+  if (evicted)
+    *evicted = victim & VALID ? (victim & ~(VALID | DIRTY)) << idx_shift : -1;
 
   if ((victim & (VALID | DIRTY)) == (VALID | DIRTY))
   {
     uint64_t dirty_addr = (victim & ~(VALID | DIRTY)) << idx_shift;
     if (miss_handler)
-      miss_handler->access(dirty_addr, linesz, true);
+      miss_handler->access(dirty_addr, linesz, true, pc);
     writebacks++;
   }
 
   if (miss_handler)
-    miss_handler->access(addr & ~(linesz-1), linesz, false);
+    miss_handler->access(addr & ~(linesz-1), linesz, false, pc);
 
   if (store)
     *check_tag(addr) |= DIRTY;
+  return false;
 }
 
-fa_cache_sim_t::fa_cache_sim_t(size_t ways, size_t linesz, const char* name)
-  : cache_sim_t(1, ways, linesz, name)
+cache_stats_t cache_sim_t::get_stats()
 {
+  return cache_stats_t{read_accesses, read_misses, bytes_read, write_accesses,
+                       write_misses, bytes_written, writebacks};
+}
+
+void cache_sim_t::set_attribution(size_t region_size)
+{
+  if (region_size < 2 || (region_size & (region_size-1)))
+  {
+    fprintf(stderr, "error: attribution regions must be a power of 2 bytes\n");
+    exit(1);
+  }
+  region_shift = __builtin_ctzl(region_size);
+}
+
+bool cache_sim_t::invalidate(uint64_t addr, bool* dirty)
+{
+  uint64_t* line = check_tag(addr);
+  if (line == NULL)
+    return false;
+  *dirty = *line & DIRTY;
+  *line = 0;
+  return true;
+}
+
+bool cache_sim_t::clean(uint64_t addr)
+{
+  uint64_t* line = check_tag(addr);
+  if (line == NULL || !(*line & DIRTY))
+    return false;
+  *line &= ~DIRTY;
+  return true;
+}
+
+fa_cache_sim_t::fa_cache_sim_t(size_t ways, size_t linesz, const char* name, policy_t policy)
+  : cache_sim_t(1, ways, linesz, name, policy), lines(ways + 1)
+{
+  index.reserve(ways);
+  lines[ways].prev = lines[ways].next = ways;
+  for (size_t i = ways; i > 0; i--)
+    free_lines.push_back(i - 1);
+}
+
+void fa_cache_sim_t::unlink(size_t i)
+{
+  lines[lines[i].prev].next = lines[i].next;
+  lines[lines[i].next].prev = lines[i].prev;
+}
+
+void fa_cache_sim_t::push_front(size_t i)
+{
+  lines[i].prev = ways;
+  lines[i].next = lines[ways].next;
+  lines[lines[ways].next].prev = i;
+  lines[ways].next = i;
 }
 
 uint64_t* fa_cache_sim_t::check_tag(uint64_t addr)
 {
-  auto it = tags.find(addr >> idx_shift);
-  return it == tags.end() ? NULL : &it->second;
+  auto it = index.find(addr >> idx_shift);
+  return it == index.end() ? NULL : &lines[it->second].tag;
+}
+
+void fa_cache_sim_t::hit(uint64_t* line)
+{
+  if (policy == LRU)
+  {
+    size_t i = (line_t*)line - &lines[0];
+    unlink(i);
+    push_front(i);
+  }
 }
 
 uint64_t fa_cache_sim_t::victimize(uint64_t addr)
 {
   uint64_t old_tag = 0;
-  if (tags.size() == ways)
+  size_t i;
+  if (!free_lines.empty())
+  {
+    i = free_lines.back();
+    free_lines.pop_back();
+  }
+  else
   {
-    auto it = tags.begin();
-    std::advance(it, lfsr.next() % ways);
-    old_tag = it->second;
-    tags.erase(it);
+    // the back of the list is the least recently used or oldest line
+    i = policy == RANDOM ? lfsr.next() % ways : lines[ways].prev;
+    old_tag = lines[i].tag;
+    index.erase(old_tag & ~(VALID | DIRTY));
+    unlink(i);
   }
-  tags[addr >> idx_shift] = (addr >> idx_shift) | VALID;
+  lines[i].tag = (addr >> idx_shift) | VALID;
+  index[addr >> idx_shift] = i;
+  push_front(i);
   return old_tag;
 }
+
+bool fa_cache_sim_t::invalidate(uint64_t addr, bool* dirty)
+{
+  auto it = index.find(addr >> idx_shift);
+  if (it == index.end())
+    return false;
+  *dirty = lines[it->second].tag & DIRTY;
+  unlink(it->second);
+  free_lines.push_back(it->second);
+  index.erase(it);
+  return true;
+}
+
+coherent_cache_sim_t::coherent_cache_sim_t(size_t nharts, const std::string& ic,
+                                           const std::string& dc, const std::string& l2_config)
+  : l2(NULL), linesz(0), attribution(false), invalidations(0), coherence_misses(0), false_sharing(0),
+    coherence_writebacks(0)
+{
+  if (nharts > MAX_HARTS)
+  {
+    fprintf(stderr, "error: the cache models support at most %zu harts\n", MAX_HARTS);
+    exit(1);
+  }
+
+  if (!l2_config.empty())
+    l2 = cache_sim_t::construct(l2_config.c_str(), "L2$");
+
+  // with one hart, the caches keep their usual names
+  for (size_t i = 0; i < nharts; i++)
+  {
+    std::string suffix = nharts > 1 ? " " + std::to_string(i) : "";
+    if (!ic.empty())
+      l1i.push_back(cache_sim_t::construct(ic.c_str(), ("I$" + suffix).c_str()));
+    if (!dc.empty())
+      l1d.push_back(cache_sim_t::construct(dc.c_str(), ("D$" + suffix).c_str()));
+  }
+  for (size_t i = 0; i < l1i.size(); i++)
+    l1i[i]->set_miss_handler(l2);
+  for (size_t i = 0; i < l1d.size(); i++)
+    l1d[i]->set_miss_handler(l2);
+
+  if (!l1d.empty())
+  {
+    linesz = l1d[0]->get_linesz();
+    chunk = std::max(linesz / 64, size_t(1));
+  }
+}
+
+coherent_cache_sim_t::~coherent_cache_sim_t()
+{
+  // the L1s print their statistics before the L2 behind them
+  for (size_t i = 0; i < l1i.size(); i++)
+    delete l1i[i];
+  for (size_t i = 0; i < l1d.size(); i++)
+    delete l1d[i];
+  delete l2;
+  print_stats();
+}
+
+std::vector<cache_sim_t*> coherent_cache_sim_t::get_caches()
+{
+  std::vector<cache_sim_t*> caches(l1i);
+  caches.insert(caches.end(), l1d.begin(), l1d.end());
+  if (l2)
+    caches.push_back(l2);
+  return caches;
+}
+
+void coherent_cache_sim_t::set_attribution(size_t region_size)
+{
+  std::vector<cache_sim_t*> caches = get_caches();
+  for (size_t i = 0; i < caches.size(); i++)
+    caches[i]->set_attribution(region_size);
+  attribution = true;
+}
+
+void coherent_cache_sim_t::access(size_t hart, uint64_t addr, size_t bytes, bool store, bool fetch,
+                                  uint64_t pc)
+{
+  if (fetch)
+  {
+    if (!l1i.empty())
+      l1i[hart]->access(addr, bytes, false, pc);
+  }
+  else if (!l1d.empty())
+    data_access(hart, addr, bytes, store, pc);
+}
+
+uint64_t coherent_cache_sim_t::chunks(uint64_t addr, size_t bytes)
+{
+  size_t first = (addr & (linesz-1)) / chunk;
+  size_t last = ((addr & (linesz-1)) + bytes - 1) / chunk;
+  if (last >= 63)
+    return -(uint64_t(1) << first);
+  return (uint64_t(2) << last) - (uint64_t(1) << first);
+}
+
+void coherent_cache_sim_t::data_access(size_t hart, uint64_t addr, size_t bytes, bool store,
+                                       uint64_t pc)
+{
+  uint64_t line = addr & ~uint64_t(linesz-1);
+  uint64_t me = uint64_t(1) << hart;
+  dir_entry_t& e = directory.emplace(line, dir_entry_t{0, 0, -1}).first->second;
+
+  if (store)
+  {
+    // gain exclusive ownership: the other copies are invalidated, and a
+    // modified one is written back on its way out
+    for (size_t i = 0; i < l1d.size(); i++)
+    {
+      bool dirty;
+      if (i == hart || !(e.sharers & (uint64_t(1) << i)) || !l1d[i]->invalidate(line, &dirty))
+        continue;
+      invalidations++;
+      lines[line].invalidations++;
+      if (dirty)
+      {
+        coherence_writebacks++;
+        if (l2)
+          l2->access(line, linesz, true);
+      }
+      e.lost |= uint64_t(1) << i;
+      written[lost_key(line, i)] = 0;
+    }
+    e.sharers &= me;
+
+    // remember what the harts that lost the line missed
+    for (uint64_t lost = e.lost & ~me; lost; lost &= lost - 1)
+      written[lost_key(line, __builtin_ctzl(lost))] |= chunks(addr, bytes);
+  }
+  else if (e.owner >= 0 && size_t(e.owner) != hart)
+  {
+    // the owner's modified copy is written back, and becomes shared
+    if (l1d[e.owner]->clean(line))
+    {
+      coherence_writebacks++;
+      if (l2)
+        l2->access(line, linesz, true);
+    }
+    e.owner = -1;
+  }
+
+  uint64_t evicted;
+  bool hit = l1d[hart]->access(addr, bytes, store, pc, &evicted);
+
+  if (!hit && (e.lost & me))
+  {
+    coherence_misses++;
+    line_stats_t& s = lines[line];
+    s.coherence_misses++;
+    auto it = written.find(lost_key(line, hart));
+    if (!(it->second & chunks(addr, bytes)))
+    {
+      false_sharing++;
+      s.false_sharing++;
+    }
+    written.erase(it);
+    e.lost &= ~me;
+  }
+
+  e.sharers |= me;
+  if (store)
+    e.owner = hart;
+
+  if (evicted != uint64_t(-1))
+  {
+    // a modified line was written back to the L2 by the eviction itself
+    auto it = directory.find(evicted);
+    it->second.sharers &= ~me;
+    if (it->second.owner == int(hart))
+      it->second.owner = -1;
+    if (it->second.sharers == 0 && it->second.lost == 0)
+      directory.erase(it);
+  }
+}
+
+void coherent_cache_sim_t::print_stats()
+{
+  if (l1d.size() < 2)
+    return;
+
+  std::cout << "Coherence Invalidations:       " << invalidations << std::endl;
+  std::cout << "Coherence Misses:              " << coherence_misses << std::endl;
+  std::cout << "Coherence False Sharing:       " << false_sharing << std::endl;
+  std::cout << "Coherence Writebacks:          " << coherence_writebacks << std::endl;
+
+  std::vector<std::pair<uint64_t, uint64_t>> hot;
+  for (auto it = lines.begin(); it != lines.end(); ++it)
+    hot.push_back(std::make_pair(it->second.invalidations, it->first));
+  std::sort(hot.rbegin(), hot.rend());
+  for (size_t i = 0; i < std::min(hot.size(), size_t(HOT_LINES)); i++)
+  {
+    const line_stats_t& s = lines[hot[i].second];
+    std::cout << "Coherence Line 0x" << std::hex << hot[i].second << std::dec << ": "
+              << s.invalidations << " invalidations, " << s.coherence_misses
+              << " coherence misses, " << s.false_sharing << " false sharing" << std::endl;
+  }
+}
+
+static void sweep_help()
+{
+  std::cerr << "Cache sweeps must be of the form" << std::endl;
+  std::cerr << "  sets:ways:blocksize" << std::endl;
+  std::cerr << "where sets and ways are powers of two or ranges of them, such as" << std::endl;
+  std::cerr << "64-4096, and blocksize is a power of two, at least 8." << std::endl;
+  exit(1);
+}
+
+// parse a power of 2, or a range of them
+static void parse_range(const std::string& s, size_t* lo, size_t* hi)
+{
+  size_t dash = s.find('-');
+  *lo = atol(s.substr(0, dash).c_str());
+  *hi = dash == std::string::npos ? *lo : atol(s.substr(dash + 1).c_str());
+  if (*lo == 0 || (*lo & (*lo - 1)) || *hi < *lo || (*hi & (*hi - 1)))
+    sweep_help();
+}
+
+cache_sweep_t::cache_sweep_t(const char* config, const char* name, bool fetch)
+  : accesses(0), fetches(fetch), name(name)
+{
+  const char* wp = strchr(config, ':');
+  if (!wp++) sweep_help();
+  const char* bp = strchr(wp, ':');
+  if (!bp++) sweep_help();
+
+  size_t min_sets, max_sets;
+  parse_range(std::string(config, wp - 1), &min_sets, &max_sets);
+  parse_range(std::string(wp, bp - 1), &min_ways, &max_ways);
+  linesz = atol(bp);
+  if (linesz < 8 || (linesz & (linesz - 1)))
+    sweep_help();
+
+  idx_shift = 0;
+  for (size_t x = linesz; x > 1; x >>= 1)
+    idx_shift++;
+
+  for (size_t sets = min_sets; sets <= max_sets; sets *= 2)
+  {
+    level_t l;
+    l.sets = sets;
+    l.stacks.resize(sets * max_ways);
+    l.hits.resize(max_ways);
+    levels.push_back(l);
+  }
+}
+
+cache_sweep_t::~cache_sweep_t()
+{
+  print_stats();
+}
+
+void cache_sweep_t::access(uint64_t addr)
+{
+  // lines are stored with the valid bit, so 0 is an empty slot
+  static const uint64_t VALID = 1ULL << 63;
+  uint64_t line = (addr >> idx_shift) | VALID;
+  accesses++;
+
+  for (size_t i = 0; i < levels.size(); i++)
+  {
+    level_t& l = levels[i];
+    uint64_t* stack = &l.stacks[(line & (l.sets - 1)) * max_ways];
+
+    size_t d = 0;
+    while (d < max_ways && stack[d] != line)
+      d++;
+    if (d < max_ways)
+      l.hits[d]++;
+    else
+      d = max_ways - 1; // a miss in every cache; the LRU line drops out
+
+    memmove(stack + 1, stack, d * sizeof(uint64_t));
+    stack[0] = line;
+  }
+}
+
+void cache_sweep_t::print_stats()
+{
+  if (accesses == 0)
+    return;
+
+  std::cout << std::setprecision(3) << std::fixed;
+  std::cout << name << " LRU miss rates for " << accesses << " accesses, "
+            << linesz << "-byte blocks" << std::endl;
+  std::cout << name << "     sets";
+  for (size_t w = min_ways; w <= max_ways; w *= 2)
+    std::cout << std::setw(9) << w << "-way";
+  std::cout << std::endl;
+
+  for (size_t i = 0; i < levels.size(); i++)
+  {
+    std::cout << name << " " << std::setw(8) << levels[i].sets;
+    uint64_t hits = 0;
+    for (size_t w = 1, d = 0; w <= max_ways; w++)
+    {
+      hits += levels[i].hits[d++];
+      if (w >= min_ways && (w & (w - 1)) == 0)
+        std::cout << std::setw(12) << 100.0 * (accesses - hits) / accesses << '%';
+    }
+    std::cout << std::endl;
+  }
+}
+
+cache_stats_writer_t::cache_stats_writer_t(const char* file, const std::vector<cache_sim_t*>& caches,
+                                           uint64_t interval)
+  : file(file), caches(caches), interval(interval), instructions(0)
+{
+}
+
+void cache_stats_writer_t::snapshot()
+{
+  snapshot_t s = {instructions, std::vector<cache_stats_t>()};
+  for (size_t i = 0; i < caches.size(); i++)
+    s.stats.push_back(caches[i]->get_stats());
+  snapshots.push_back(s);
+}
+
+// the misses of a cache by pc or region, most first
+static std::vector<std::pair<uint64_t, miss_count_t>>
+sorted_misses(const std::unordered_map<uint64_t, miss_count_t>& m)
+{
+  std::vector<std::pair<uint64_t, miss_count_t>> v(m.begin(), m.end());
+  std::sort(v.begin(), v.end(), [](const std::pair<uint64_t, miss_count_t>& a,
+                                    const std::pair<uint64_t, miss_count_t>& b) {
+    uint64_t ma = a.second.read_misses + a.second.write_misses;
+    uint64_t mb = b.second.read_misses + b.second.write_misses;
+    return ma != mb ? ma > mb : a.first < b.first;
+  });
+  return v;
+}
+
+// quote a string for JSON or CSV, which both escape quotes by prefixing
+// them with the given character
+static std::string quote(const std::string& s, char escape)
+{
+  std::string res = "\"";
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    if (s[i] == '"' || s[i] == escape)
+      res += escape;
+    res += s[i];
+  }
+  return res + "\"";
+}
+
+static void write_json_stats(FILE* f, const cache_stats_t& s)
+{
+  fprintf(f, "\"read_accesses\": %" PRIu64 ", \"read_misses\": %" PRIu64 ", "
+             "\"bytes_read\": %" PRIu64 ", \"write_accesses\": %" PRIu64 ", "
+             "\"write_misses\": %" PRIu64 ", \"bytes_written\": %" PRIu64 ", "
+             "\"writebacks\": %" PRIu64,
+          s.read_accesses, s.read_misses, s.bytes_read, s.write_accesses,
+          s.write_misses, s.bytes_written, s.writebacks);
+}
+
+static void write_json_misses(FILE* f, const char* what, const char* key,
+                              const std::unordered_map<uint64_t, miss_count_t>& m)
+{
+  auto v = sorted_misses(m);
+  fprintf(f, ",\n     \"%s\": [", what);
+  for (size_t i = 0; i < v.size(); i++)
+    fprintf(f, "%s\n       {\"%s\": \"0x%" PRIx64 "\", \"read_misses\": %" PRIu64
+               ", \"write_misses\": %" PRIu64 "}",
+            i ? "," : "", key, v[i].first, v[i].second.read_misses, v[i].second.write_misses);
+  fprintf(f, "]");
+}
+
+void cache_stats_writer_t::write_json(FILE* f)
+{
+  fprintf(f, "{\n  \"caches\": [");
+  for (size_t i = 0; i < caches.size(); i++)
+  {
+    fprintf(f, "%s\n    {\"name\": %s, ", i ? "," : "", quote(caches[i]->get_name(), '\\').c_str());
+    write_json_stats(f, caches[i]->get_stats());
+    if (caches[i]->attributing())
+    {
+      write_json_misses(f, "misses_by_pc", "pc", caches[i]->get_pc_misses());
+      write_json_misses(f, "misses_by_region", "addr", caches[i]->get_region_misses());
+    }
+    fprintf(f, "}");
+  }
+  fprintf(f, "]");
+
+  if (interval)
+  {
+    fprintf(f, ",\n  \"instructions\": %" PRIu64 ",\n  \"interval\": %" PRIu64 ",\n  \"snapshots\": [",
+            instructions, interval);
+    for (size_t i = 0; i < snapshots.size(); i++)
+    {
+      fprintf(f, "%s\n    {\"instructions\": %" PRIu64 ", \"caches\": [",
+              i ? "," : "", snapshots[i].instructions);
+      for (size_t j = 0; j < caches.size(); j++)
+      {
+        fprintf(f, "%s\n      {\"name\": %s, ", j ? "," : "", quote(caches[j]->get_name(), '\\').c_str());
+        write_json_stats(f, snapshots[i].stats[j]);
+        fprintf(f, "}");
+      }
+      fprintf(f, "]}");
+    }
+    fprintf(f, "]");
+  }
+  fprintf(f, "\n}\n");
+}
+
+static void write_csv_stats(FILE* f, const char* record, uint64_t instructions,
+                            const std::string& cache, const cache_stats_t& s)
+{
+  fprintf(f, "%s,%" PRIu64 ",%s,,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+             ",%" PRIu64 ",%" PRIu64 "\n",
+          record, instructions, quote(cache, '"').c_str(), s.read_accesses, s.read_misses,
+          s.bytes_read, s.write_accesses, s.write_misses, s.bytes_written, s.writebacks);
+}
+
+static void write_csv_misses(FILE* f, const char* record, const std::string& cache,
+                             const std::unordered_map<uint64_t, miss_count_t>& m)
+{
+  auto v = sorted_misses(m);
+  for (size_t i = 0; i < v.size(); i++)
+    fprintf(f, "%s,,%s,0x%" PRIx64 ",,%" PRIu64 ",,,%" PRIu64 ",,\n",
+            record, quote(cache, '"').c_str(), v[i].first,
+            v[i].second.read_misses, v[i].second.write_misses);
+}
+
+// one row per cache and snapshot, then the totals, then the misses of
+// each pc and region, which only fill in the address and miss counts
+void cache_stats_writer_t::write_csv(FILE* f)
+{
+  fprintf(f, "record,instructions,cache,address,read_accesses,read_misses,bytes_read,"
+             "write_accesses,write_misses,bytes_written,writebacks\n");
+  for (size_t i = 0; i < snapshots.size(); i++)
+    for (size_t j = 0; j < caches.size(); j++)
+      write_csv_stats(f, "snapshot", snapshots[i].instructions, caches[j]->get_name(),
+                      snapshots[i].stats[j]);
+  for (size_t i = 0; i < caches.size(); i++)
+    write_csv_stats(f, "total", instructions, caches[i]->get_name(), caches[i]->get_stats());
+  for (size_t i = 0; i < caches.size(); i++)
+  {
+    if (!caches[i]->attributing())
+      continue;
+    write_csv_misses(f, "pc", caches[i]->get_name(), caches[i]->get_pc_misses());
+    write_csv_misses(f, "region", caches[i]->get_name(), caches[i]->get_region_misses());
+  }
+}
+
+cache_stats_writer_t::~cache_stats_writer_t()
+{
+  FILE* f = fopen(file.c_str(), "w");
+  if (f == NULL)
+  {
+    fprintf(stderr, "error: could not write cache statistics %s: %s\n", file.c_str(), strerror(errno));
+    return;
+  }
+  bool csv = file.size() >= 4 && file.compare(file.size() - 4, 4, ".csv") == 0;
+  csv ? write_csv(f) : write_json(f);
+  if (fclose(f) != 0)
+    fprintf(stderr, "error: could not write cache statistics %s\n", file.c_str());
+}
+
+access_buffer_t::access_buffer_t(uint16_t hart, size_t entries, bool fetches, bool data,
+                                 bool pcs)
+  : ring(entries), mask(entries - 1), hart(hart), fetches(fetches), data(data), pcs(pcs),
+    head(0), tail(0)
+{
+}
+
+access_stream_t::access_stream_t(size_t nharts, const std::vector<memtracer_t*>& m,
+                                 coherent_cache_sim_t* caches, const char* file)
+  : caches(caches), file(file ? file : ""), f(NULL), piped(false), done(false)
+{
+  bool fetches = file != NULL || (caches && caches->fetches());
+  bool data = file != NULL || (caches && caches->data());
+  bool pcs = file != NULL || (caches && caches->attributing());
+  for (size_t i = 0; i < m.size(); i++)
+  {
+    models.hook(m[i]);
+    pcs |= m[i]->needs_pc();
+    fetches |= m[i]->interested_in_range(0, -1, false, true);
+    data |= m[i]->interested_in_range(0, -1, false, false) ||
+            m[i]->interested_in_range(0, -1, true, false);
+  }
+
+  if (file)
+  {
+    std::string cmd = trace_t::compressor(file, false);
+    piped = !cmd.empty();
+    f = piped ? popen(cmd.c_str(), "w") : fopen(file, "w");
+    if (f == NULL)
+    {
+      fprintf(stderr, "error: could not open %s: %s\n", file, strerror(errno));
+      exit(-1);
+    }
+    uint64_t header[] = {ACCESS_MAGIC, ACCESS_VERSION, sizeof(mem_access_t)};
+    fwrite(header, sizeof(header), 1, f);
+  }
+
+  for (size_t i = 0; i < nharts; i++)
+    buffers.push_back(new access_buffer_t(i, BUFFER_ENTRIES, fetches, data, pcs));
+
+  consumer = std::thread(&access_stream_t::consume_loop, this);
+}
+
+access_stream_t::~access_stream_t()
+{
+  done = true;
+  consumer.join();
+
+  for (size_t i = 0; i < buffers.size(); i++)
+    delete buffers[i];
+
+  if (f && (piped ? pclose(f) : fclose(f)) != 0)
+    fprintf(stderr, "error: could not write %s\n", file.c_str());
+}
+
+bool access_stream_t::drain(access_buffer_t* b)
+{
+  size_t tail = b->tail.load(std::memory_order_relaxed);
+  size_t head = b->head.load(std::memory_order_acquire);
+  if (head == tail)
+    return false;
+
+  // take up to the end of the ring; the rest goes next time round
+  size_t begin = tail & b->mask;
+  size_t n = std::min(head - tail, b->ring.size() - begin);
+  const mem_access_t* a = &b->ring[begin];
+  if (f && fwrite(a, sizeof(mem_access_t), n, f) != n)
+  {
+    fprintf(stderr, "error: could not write %s: %s\n", file.c_str(), strerror(errno));
+    exit(-1);
+  }
+  for (size_t i = 0; i < n; i++)
+  {
+    bool store = a[i].type == mem_access_t::STORE, fetch = a[i].type == mem_access_t::FETCH;
+    models.trace(a[i].addr, a[i].bytes, store, fetch, a[i].pc);
+    if (caches)
+      caches->access(a[i].hart, a[i].addr, a[i].bytes, store, fetch, a[i].pc);
+  }
+
+  b->tail.store(tail + n, std::memory_order_release);
+  return true;
+}
+
+void access_stream_t::consume_loop()
+{
+  while (true)
+  {
+    // check for shutdown before draining, so the last accesses get counted
+    bool finishing = done;
+    bool busy = false;
+    for (size_t i = 0; i < buffers.size(); i++)
+      busy |= drain(buffers[i]);
+    if (finishing && !busy)
+      break;
+    if (!busy)
+      usleep(100);
+  }
+}
@@ -4,9 +4,13 @@
 #define _RISCV_CACHE_SIM_H
 
 #include "memtracer.h"
+#include <atomic>
+#include <cstdio>
 #include <cstring>
 #include <string>
-#include <map>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <cstdint>
 
 class lfsr_t
@@ -19,16 +23,57 @@ class lfsr_t
   uint32_t reg;
 };
 
+struct cache_stats_t
+{
+  uint64_t read_accesses;
+  uint64_t read_misses;
+  uint64_t bytes_read;
+  uint64_t write_accesses;
+  uint64_t write_misses;
+  uint64_t bytes_written;
+  uint64_t writebacks;
+};
+
+// misses caused by one pc, or in one region of memory
+struct miss_count_t
+{
+  uint64_t read_misses;
+  uint64_t write_misses;
+};
+
 class cache_sim_t
 {
  public:
-  cache_sim_t(size_t sets, size_t ways, size_t linesz, const char* name);
+  enum policy_t { RANDOM, LRU, PLRU, FIFO, RRIP };
+
+  cache_sim_t(size_t sets, size_t ways, size_t linesz, const char* name,
+              policy_t policy = RANDOM);
   cache_sim_t(const cache_sim_t& rhs);
   virtual ~cache_sim_t();
 
-  void access(uint64_t addr, size_t bytes, bool store);
+  // returns true on a hit.  pc is the instruction making the access, for
+  // attribution.  if a miss evicts a valid line and evicted isn't NULL,
+  // the line's address is stored there (otherwise -1 is).
+  bool access(uint64_t addr, size_t bytes, bool store, uint64_t pc = 0,
+              uint64_t* evicted = NULL);
   void print_stats();
   void set_miss_handler(cache_sim_t* mh) { miss_handler = mh; }
+  size_t get_linesz() { return linesz; }
+  const std::string& get_name() { return name; }
+  cache_stats_t get_stats();
+
+  // count misses by pc, and by naturally aligned region of region_size
+  // bytes (a power of 2)
+  void set_attribution(size_t region_size);
+  bool attributing() { return region_shift != 0; }
+  const std::unordered_map<uint64_t, miss_count_t>& get_pc_misses() { return pc_misses; }
+  const std::unordered_map<uint64_t, miss_count_t>& get_region_misses() { return region_misses; }
+
+  // coherence actions on the line holding addr: invalidate returns whether
+  // the line was present, and whether it was dirty in *dirty; clean
+  // returns whether the line was dirty, and leaves it clean
+  virtual bool invalidate(uint64_t addr, bool* dirty);
+  bool clean(uint64_t addr);
 
   static cache_sim_t* construct(const char* config, const char* name);
 
@@ -36,8 +81,11 @@ class cache_sim_t
   static const uint64_t VALID = 1ULL << 63;
   static const uint64_t DIRTY = 1ULL << 62;
 
+  static const uint64_t RRPV_MAX = 3;
+
   virtual uint64_t* check_tag(uint64_t addr);
   virtual uint64_t victimize(uint64_t addr);
+  virtual void hit(uint64_t* line); // tell the policy about a hit
 
   lfsr_t lfsr;
   cache_sim_t* miss_handler;
@@ -46,8 +94,14 @@ class cache_sim_t
   size_t ways;
   size_t linesz;
   size_t idx_shift;
+  policy_t policy;
 
   uint64_t* tags;
+  // per-line policy state: the time of the last use (LRU) or fill (FIFO),
+  // the re-reference prediction (RRIP), or the nodes of the set's tree
+  // (PLRU, with node n at way n)
+  uint64_t* repl;
+  uint64_t clock;
   
   uint64_t read_accesses;
   uint64_t read_misses;
@@ -57,20 +111,41 @@ class cache_sim_t
   uint64_t bytes_written;
   uint64_t writebacks;
 
+  size_t region_shift; // 0 unless attributing
+  std::unordered_map<uint64_t, miss_count_t> pc_misses;
+  std::unordered_map<uint64_t, miss_count_t> region_misses;
+
   std::string name;
 
   void init();
+  size_t pick_victim(size_t idx);
+  void update(size_t idx, size_t way, bool fill);
 };
 
+// a fully-associative cache, with lines found through a hash table and
+// kept in a list ordered by last use (LRU) or fill (FIFO), so hits and
+// misses take constant time whatever the number of ways
 class fa_cache_sim_t : public cache_sim_t
 {
  public:
-  fa_cache_sim_t(size_t ways, size_t linesz, const char* name);
+  fa_cache_sim_t(size_t ways, size_t linesz, const char* name, policy_t policy);
   uint64_t* check_tag(uint64_t addr);
   uint64_t victimize(uint64_t addr);
+  void hit(uint64_t* line);
+  bool invalidate(uint64_t addr, bool* dirty);
  private:
-  static bool cmp(uint64_t a, uint64_t b);
-  std::map<uint64_t, uint64_t> tags;
+  struct line_t
+  {
+    uint64_t tag;
+    size_t prev;
+    size_t next;
+  };
+  std::vector<line_t> lines; // lines[ways] heads the list
+  std::unordered_map<uint64_t, size_t> index;
+  std::vector<size_t> free_lines;
+
+  void unlink(size_t i);
+  void push_front(size_t i);
 };
 
 class cache_memtracer_t : public memtracer_t
@@ -88,6 +163,8 @@ class cache_memtracer_t : public memtracer_t
   {
     cache->set_miss_handler(mh);
   }
+  cache_sim_t* get_cache() { return cache; }
+  bool needs_pc() { return cache->attributing(); }
 
  protected:
   cache_sim_t* cache;
@@ -96,29 +173,275 @@ class cache_memtracer_t : public memtracer_t
 class icache_sim_t : public cache_memtracer_t
 {
  public:
-  icache_sim_t(const char* config) : cache_memtracer_t(config, "I$") {}
+  icache_sim_t(const char* config, const char* name = "I$") : cache_memtracer_t(config, name) {}
   bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch)
   {
     return fetch;
   }
-  void trace(uint64_t addr, size_t bytes, bool store, bool fetch)
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc)
   {
-    if (fetch) cache->access(addr, bytes, false);
+    if (fetch) cache->access(addr, bytes, false, pc);
   }
 };
 
 class dcache_sim_t : public cache_memtracer_t
 {
  public:
-  dcache_sim_t(const char* config) : cache_memtracer_t(config, "D$") {}
+  dcache_sim_t(const char* config, const char* name = "D$") : cache_memtracer_t(config, name) {}
   bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch)
   {
     return !fetch;
   }
-  void trace(uint64_t addr, size_t bytes, bool store, bool fetch)
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc)
+  {
+    if (!fetch) cache->access(addr, bytes, store, pc);
+  }
+};
+
+// private L1 instruction and data caches for each hart, in front of a
+// shared L2.  the data caches are kept coherent by a MESI directory: a
+// store invalidates the line in the other harts' caches, and a load of a
+// line another hart has modified writes it back to the L2 first.  the
+// instruction caches, as in RISC-V hardware, aren't kept coherent.
+//
+// a miss on a line the hart lost to another hart's store is a coherence
+// miss.  it is also false sharing if none of the bytes stored since then
+// overlap the bytes the hart now accesses.  these counts are kept per
+// line, and the lines with the most invalidations are printed at exit.
+class coherent_cache_sim_t
+{
+ public:
+  static const size_t MAX_HARTS = 64;
+  static const size_t HOT_LINES = 10;
+
+  // any of the configurations may be empty
+  coherent_cache_sim_t(size_t nharts, const std::string& ic,
+                       const std::string& dc, const std::string& l2);
+  ~coherent_cache_sim_t(); // prints the statistics
+
+  bool fetches() { return !l1i.empty(); }
+  bool data() { return !l1d.empty(); }
+  std::vector<cache_sim_t*> get_caches();
+  void set_attribution(size_t region_size);
+  bool attributing() { return attribution; }
+  void access(size_t hart, uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc);
+  void print_stats();
+
+ private:
+  struct dir_entry_t
+  {
+    uint64_t sharers; // harts whose D$ holds the line
+    uint64_t lost;    // harts that lost the line to another hart's store
+    int owner;        // the hart that may hold the line modified, or -1
+  };
+
+  struct line_stats_t
+  {
+    uint64_t invalidations;
+    uint64_t coherence_misses;
+    uint64_t false_sharing;
+  };
+
+  std::vector<cache_sim_t*> l1i;
+  std::vector<cache_sim_t*> l1d;
+  cache_sim_t* l2;
+  size_t linesz;
+  size_t chunk; // bytes per bit of the masks of bytes written
+  bool attribution;
+
+  std::unordered_map<uint64_t, dir_entry_t> directory;
+  // bytes of a line stored by others since a hart lost it, keyed by
+  // lost_key
+  std::unordered_map<uint64_t, uint64_t> written;
+  std::unordered_map<uint64_t, line_stats_t> lines;
+
+  uint64_t invalidations;
+  uint64_t coherence_misses;
+  uint64_t false_sharing;
+  uint64_t coherence_writebacks;
+
+  uint64_t chunks(uint64_t addr, size_t bytes);
+  uint64_t lost_key(uint64_t line, size_t hart) { return line / linesz * MAX_HARTS + hart; }
+  void data_access(size_t hart, uint64_t addr, size_t bytes, bool store, uint64_t pc);
+};
+
+// computes the miss rates of a whole family of LRU caches in one pass.
+// for each number of sets, every set keeps an LRU stack as deep as the
+// largest associativity, and a histogram counts how far down the stack
+// each access hits: a cache with W ways hits exactly when the distance is
+// less than W.  the table of miss rates is printed at exit.
+class cache_sweep_t : public memtracer_t
+{
+ public:
+  // config is <S>:<W>:<B>, where S and W may be ranges such as 64-4096.
+  // sets and ways are swept over the powers of 2 in their ranges.
+  cache_sweep_t(const char* config, const char* name, bool fetch);
+  ~cache_sweep_t();
+
+  bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch)
+  {
+    return fetch == fetches;
+  }
+  bool needs_pc() { return false; }
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc)
+  {
+    if (fetch == fetches)
+      access(addr);
+  }
+
+  void access(uint64_t addr);
+  void print_stats();
+
+ private:
+  struct level_t
+  {
+    size_t sets;
+    std::vector<uint64_t> stacks; // sets * max_ways lines, MRU first
+    std::vector<uint64_t> hits;   // hits at each stack distance
+  };
+
+  std::vector<level_t> levels;
+  size_t min_ways;
+  size_t max_ways;
+  size_t idx_shift;
+  size_t linesz;
+  uint64_t accesses;
+  bool fetches;
+  std::string name;
+};
+
+// writes the statistics of a set of caches to a file when destroyed: as
+// CSV if the file name ends in .csv, and as JSON otherwise.  the misses
+// attributed to pcs and regions are included for caches that count them.
+//
+// with an interval, it also counts the instructions fetched, and every
+// interval of them takes a snapshot of the (cumulative) statistics.  it
+// must then see fetches, and with several harts the snapshots are only
+// approximate, as their accesses are interleaved in chunks.
+class cache_stats_writer_t : public memtracer_t
+{
+ public:
+  cache_stats_writer_t(const char* file, const std::vector<cache_sim_t*>& caches,
+                       uint64_t interval);
+  ~cache_stats_writer_t();
+
+  bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch)
+  {
+    return fetch && interval;
+  }
+  bool needs_pc() { return false; }
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc)
+  {
+    if (fetch && interval && ++instructions % interval == 0)
+      snapshot();
+  }
+
+ private:
+  struct snapshot_t
+  {
+    uint64_t instructions;
+    std::vector<cache_stats_t> stats;
+  };
+
+  std::string file;
+  std::vector<cache_sim_t*> caches;
+  uint64_t interval;
+  uint64_t instructions;
+  std::vector<snapshot_t> snapshots;
+
+  void snapshot();
+  void write_json(FILE* f);
+  void write_csv(FILE* f);
+};
+
+// one access made by a hart, as recorded by an access_stream_t
+struct mem_access_t
+{
+  static const uint8_t LOAD = 0;
+  static const uint8_t STORE = 1;
+  static const uint8_t FETCH = 2;
+
+  uint64_t addr; // physical
+  uint64_t pc;   // virtual
+  uint32_t bytes;
+  uint16_t hart;
+  uint8_t type;
+  uint8_t pad;
+};
+
+// a hart's accesses, on their way to an access_stream_t.  it is
+// registered with the hart's MMU in place of the cache models themselves,
+// so the hart only has to append to a ring buffer.
+class access_buffer_t : public memtracer_t
+{
+ public:
+  access_buffer_t(uint16_t hart, size_t entries, bool fetches, bool data, bool pcs);
+
+  bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch)
+  {
+    return fetch ? fetches : data;
+  }
+  bool needs_pc() { return pcs; }
+
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc)
   {
-    if (!fetch) cache->access(addr, bytes, store);
+    size_t h = head.load(std::memory_order_relaxed);
+    while (h - tail.load(std::memory_order_acquire) > mask)
+      std::this_thread::yield();
+    uint8_t type = fetch ? mem_access_t::FETCH : store ? mem_access_t::STORE : mem_access_t::LOAD;
+    ring[h & mask] = mem_access_t{addr, pc, uint32_t(bytes), hart, type, 0};
+    head.store(h + 1, std::memory_order_release);
   }
+
+ private:
+  std::vector<mem_access_t> ring;
+  size_t mask;
+  uint16_t hart;
+  bool fetches;
+  bool data;
+  bool pcs;
+  std::atomic<size_t> head; // next access the hart appends
+  std::atomic<size_t> tail; // next access the stream consumes
+
+  friend class access_stream_t;
+};
+
+// runs cache models on a background thread, fed by the harts' access
+// buffers, and optionally records the accesses to a file so the models
+// (or others) can be rerun offline with spike-cachesim.  each hart's
+// accesses are simulated in order, but those of different harts are
+// interleaved in chunks.
+//
+// files ending in .zst, .lz4 or .gz are compressed.  a file starts with
+// three host-endian 64-bit words, ACCESS_MAGIC, the version and the size
+// of an access, followed by mem_access_t records.
+class access_stream_t
+{
+ public:
+  static const uint64_t ACCESS_MAGIC = 0x4d454d454b495053; // "SPIKEMEM"
+  static const uint64_t ACCESS_VERSION = 2;
+  static const size_t BUFFER_ENTRIES = 1 << 16;
+
+  // file may be NULL to only run the models, and caches NULL if there's no
+  // coherent hierarchy to feed
+  access_stream_t(size_t nharts, const std::vector<memtracer_t*>& models,
+                  coherent_cache_sim_t* caches, const char* file);
+  ~access_stream_t(); // finishes simulating the buffered accesses
+
+  memtracer_t* get_buffer(size_t hart) { return buffers[hart]; }
+
+ private:
+  memtracer_list_t models;
+  coherent_cache_sim_t* caches;
+  std::string file;
+  FILE* f;
+  bool piped;
+  std::vector<access_buffer_t*> buffers;
+  std::atomic<bool> done;
+  std::thread consumer;
+
+  void consume_loop();
+  bool drain(access_buffer_t* b);
 };
 
 #endif
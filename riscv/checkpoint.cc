@@ -0,0 +1,66 @@
+// See LICENSE for license details.
+
+#include "checkpoint.h"
+#include "trace.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+static const uint64_t CHECKPOINT_MAGIC = 0x504b43454b495053; // "SPIKECKP"
+static const uint64_t CHECKPOINT_VERSION = 2;
+
+checkpoint_t::checkpoint_t(const char* file, bool saving)
+  : file(file), writing(saving)
+{
+  if (!saving && access(file, R_OK) != 0)
+  {
+    fprintf(stderr, "error: could not open checkpoint %s: %s\n", file, strerror(errno));
+    exit(-1);
+  }
+
+  std::string quoted = trace_t::quote(file);
+  std::string cmd = saving ? "gzip -c > " + quoted : "gzip -dc < " + quoted;
+  f = popen(cmd.c_str(), saving ? "w" : "r");
+  if (f == NULL)
+  {
+    fprintf(stderr, "error: could not run gzip for checkpoint %s\n", file);
+    exit(-1);
+  }
+
+  check(CHECKPOINT_MAGIC, "file format");
+  check(CHECKPOINT_VERSION, "version");
+}
+
+checkpoint_t::~checkpoint_t()
+{
+  if (pclose(f) != 0)
+  {
+    fprintf(stderr, "error: could not %s checkpoint %s\n",
+            writing ? "write" : "read", file.c_str());
+    exit(-1);
+  }
+}
+
+void checkpoint_t::transfer(void* data, size_t len)
+{
+  size_t n = writing ? fwrite(data, 1, len, f) : fread(data, 1, len, f);
+  if (n != len)
+  {
+    fprintf(stderr, "error: could not %s checkpoint %s\n",
+            writing ? "write" : "read", file.c_str());
+    exit(-1);
+  }
+}
+
+void checkpoint_t::check(uint64_t value, const char* what)
+{
+  uint64_t saved = value;
+  transfer(saved);
+  if (saved != value)
+  {
+    fprintf(stderr, "error: checkpoint %s was saved with a different %s\n",
+            file.c_str(), what);
+    exit(-1);
+  }
+}
@@ -0,0 +1,36 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_CHECKPOINT_H
+#define _RISCV_CHECKPOINT_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+
+// a gzip-compressed file of simulator state.  saving and restoring share
+// one code path: each component passes its state to transfer(), which
+// writes it out or reads it back in depending on the direction.  state is
+// stored as raw host bytes, so a checkpoint can only be restored by the
+// same build of the simulator.
+class checkpoint_t
+{
+ public:
+  checkpoint_t(const char* file, bool saving);
+  ~checkpoint_t();
+
+  bool saving() { return writing; }
+
+  void transfer(void* data, size_t len);
+  template<class T> void transfer(T& x) { transfer(&x, sizeof(x)); }
+
+  // save a value describing the machine's configuration, or on restore,
+  // check that it matches the machine being restored into
+  void check(uint64_t value, const char* what);
+
+ private:
+  std::string file;
+  FILE* f;
+  bool writing;
+};
+
+#endif
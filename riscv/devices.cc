@@ -0,0 +1,244 @@
+// See LICENSE for license details.
+
+#include "devices.h"
+#include "checkpoint.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void bus_t::add_device(reg_t addr, abstract_device_t* dev, reg_t size)
+{
+  auto next = sizes.lower_bound(addr);
+  bool overlaps = next != sizes.end() && next->first - addr < size;
+  if (next != sizes.begin())
+  {
+    auto prev = std::prev(next);
+    overlaps = overlaps || addr - prev->first < prev->second;
+  }
+  if (overlaps)
+  {
+    fprintf(stderr, "error: device at 0x%" PRIx64 " overlaps another\n", addr);
+    exit(-1);
+  }
+
+  devices[addr] = dev;
+  sizes[addr] = size;
+}
+
+// find the device mapped at addr, and make addr relative to its base
+abstract_device_t* bus_t::find_device(reg_t& addr)
+{
+  auto it = devices.upper_bound(addr);
+  if (it == devices.begin())
+    return NULL;
+  it--;
+  addr -= it->first;
+  return it->second;
+}
+
+bool bus_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  abstract_device_t* dev = find_device(addr);
+  return dev && dev->load(addr, len, bytes);
+}
+
+bool bus_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  abstract_device_t* dev = find_device(addr);
+  return dev && dev->store(addr, len, bytes);
+}
+
+// map size bytes of zeroed, lazily populated memory, backed by huge pages
+// if asked.  hugetlbfs pages can't be partly replaced by a file mapping,
+// so only transparent huge pages are used when there is an image.
+// returns NULL on failure.  if fixed is given, the memory replaces the
+// mapping there.  hugetlb is set if hugetlbfs pages were used.
+static char* map_memory(size_t size, bool hugepages, bool image, bool* hugetlb, void* fixed = NULL)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (fixed ? MAP_FIXED : 0);
+  void* mem = MAP_FAILED;
+  *hugetlb = false;
+
+#ifdef MAP_HUGETLB
+  if (hugepages && !image)
+  {
+    mem = mmap(fixed, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    *hugetlb = mem != MAP_FAILED;
+  }
+#endif
+
+  if (mem == MAP_FAILED)
+  {
+    mem = mmap(fixed, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    // fall back to transparent huge pages
+    if (hugepages)
+      madvise(mem, size, MADV_HUGEPAGE);
+#endif
+  }
+
+  return (char*)mem;
+}
+
+mem_t::mem_t(size_t size, bool hugepages, const char* image)
+  : hugepages(hugepages)
+{
+  // allocate the memory, shrinking it as necessary until the allocation
+  // succeeds
+  size_t quantum = 1L << 20;
+  sz = size;
+  while ((data = map_memory(sz, hugepages, image != NULL, &hugetlb)) == NULL)
+  {
+    sz = sz*10/11/quantum*quantum;
+    if (sz == 0)
+    {
+      fprintf(stderr, "error: could not allocate target mem: %s\n", strerror(errno));
+      exit(-1);
+    }
+  }
+
+  if (sz != size)
+    fprintf(stderr, "warning: only got %lu bytes of target mem (wanted %lu)\n",
+            (unsigned long)sz, (unsigned long)size);
+
+  if (image)
+    map_image(image);
+}
+
+mem_t::~mem_t()
+{
+  munmap(data, sz);
+}
+
+void mem_t::map_image(const char* file)
+{
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    fprintf(stderr, "error: could not open memory image %s: %s\n", file, strerror(errno));
+    exit(-1);
+  }
+
+  size_t pgsize = sysconf(_SC_PAGESIZE);
+  size_t size = std::min((size_t)st.st_size, sz);
+  size = (size + pgsize - 1) / pgsize * pgsize;
+  if (size && mmap(data, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    fprintf(stderr, "error: could not map memory image %s: %s\n", file, strerror(errno));
+    exit(-1);
+  }
+
+  if ((size_t)st.st_size > sz)
+    fprintf(stderr, "warning: memory image %s is larger than target mem\n", file);
+  if (size)
+    file_ranges.push_back(std::make_pair(reg_t(0), size));
+
+  close(fd);
+}
+
+bool mem_t::map_file(reg_t addr, size_t len, int fd, off_t offset)
+{
+  if (hugetlb)
+    return false;
+  if (mmap(data + addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+  {
+    fprintf(stderr, "error: could not map file into target mem: %s\n", strerror(errno));
+    exit(-1);
+  }
+  file_ranges.push_back(std::make_pair(addr, len));
+  return true;
+}
+
+bool mem_t::file_backed(reg_t addr, size_t len)
+{
+  for (size_t i = 0; i < file_ranges.size(); i++)
+    if (addr < file_ranges[i].first + file_ranges[i].second && file_ranges[i].first < addr + len)
+      return true;
+  return false;
+}
+
+bool mem_t::load(reg_t addr, size_t len, uint8_t* bytes)
+{
+  if (addr + len < addr || addr + len > sz)
+    return false;
+  memcpy(bytes, data + addr, len);
+  return true;
+}
+
+bool mem_t::store(reg_t addr, size_t len, const uint8_t* bytes)
+{
+  if (addr + len < addr || addr + len > sz)
+    return false;
+  memcpy(data + addr, bytes, len);
+  return true;
+}
+
+// replace the contents, including any image, with zeroes
+void mem_t::clear()
+{
+  if (map_memory(sz, hugepages, false, &hugetlb, data) != data)
+  {
+    fprintf(stderr, "error: could not clear target mem: %s\n", strerror(errno));
+    exit(-1);
+  }
+  file_ranges.clear();
+}
+
+void mem_t::checkpoint(checkpoint_t& ckpt)
+{
+  const size_t pgsize = 4096;
+  static const char zeroes[pgsize] = {};
+  uint64_t page;
+
+  if (ckpt.saving())
+  {
+    // pages the guest never touched aren't resident, and reading them
+    // would populate them, which for hugetlbfs pages may exhaust the pool.
+    // pages mapped from files may hold data without being resident.
+    size_t host_pgsize = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident((sz + host_pgsize - 1) / host_pgsize);
+    if (mincore(data, sz, resident.data()) != 0)
+    {
+      fprintf(stderr, "error: could not find the resident pages of target mem: %s\n", strerror(errno));
+      exit(-1);
+    }
+
+    for (page = 0; page < sz / pgsize; page++)
+    {
+      if (!(resident[page * pgsize / host_pgsize] & 1)
+          && !file_backed(page * pgsize, pgsize))
+        continue;
+      if (memcmp(data + page * pgsize, zeroes, pgsize) != 0)
+      {
+        ckpt.transfer(page);
+        ckpt.transfer(data + page * pgsize, pgsize);
+      }
+    }
+    page = -1;
+    ckpt.transfer(page);
+  }
+  else
+  {
+    clear();
+    for (ckpt.transfer(page); page != uint64_t(-1); ckpt.transfer(page))
+    {
+      if (page >= sz / pgsize)
+      {
+        fprintf(stderr, "error: checkpoint has a page beyond the end of target mem\n");
+        exit(-1);
+      }
+      ckpt.transfer(data + page * pgsize, pgsize);
+    }
+  }
+}
@@ -0,0 +1,82 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_DEVICES_H
+#define _RISCV_DEVICES_H
+
+#include "decode.h"
+#include <map>
+#include <vector>
+#include <sys/types.h>
+
+class checkpoint_t;
+
+// a target of physical memory accesses.  addresses are offsets from the
+// base at which the device is mapped; accesses the device doesn't
+// implement return false, which the hart sees as an access fault.
+class abstract_device_t
+{
+ public:
+  virtual bool load(reg_t addr, size_t len, uint8_t* bytes) = 0;
+  virtual bool store(reg_t addr, size_t len, const uint8_t* bytes) = 0;
+  virtual ~abstract_device_t() {}
+};
+
+// dispatches accesses to the device mapped at the highest base address
+// at or below the target address
+class bus_t : public abstract_device_t
+{
+ public:
+  bool load(reg_t addr, size_t len, uint8_t* bytes);
+  bool store(reg_t addr, size_t len, const uint8_t* bytes);
+
+  // map a device that claims size bytes from addr.  a device that doesn't
+  // give its size claims only its base.  it is an error for claims to
+  // overlap.
+  void add_device(reg_t addr, abstract_device_t* dev, reg_t size = 1);
+
+ private:
+  std::map<reg_t, abstract_device_t*> devices;
+  std::map<reg_t, reg_t> sizes;
+  abstract_device_t* find_device(reg_t& addr);
+};
+
+// a region of target RAM.  it is mapped lazily, so untouched pages cost
+// nothing, and may be backed by huge pages.  if an image file is given,
+// it is mapped privately over the bottom of the region, so the page cache
+// is shared with other simulators using the same image, and pages are
+// copied only once they are written.
+class mem_t : public abstract_device_t
+{
+ public:
+  mem_t(size_t size, bool hugepages, const char* image = NULL);
+  ~mem_t();
+
+  bool load(reg_t addr, size_t len, uint8_t* bytes);
+  bool store(reg_t addr, size_t len, const uint8_t* bytes);
+
+  char* contents() { return data; }
+  size_t size() { return sz; }
+
+  // map len bytes of a file, from offset, copy-on-write over the memory
+  // at addr.  all three must be page-aligned.  returns false if the memory
+  // is backed by hugetlbfs pages, which can't be partly replaced.
+  bool map_file(reg_t addr, size_t len, int fd, off_t offset);
+
+  // save or restore the contents, skipping pages of zeroes
+  void checkpoint(checkpoint_t& ckpt);
+
+ private:
+  char* data;
+  size_t sz;
+  bool hugepages;
+  bool hugetlb; // backed by hugetlbfs pages
+
+  // the ranges mapped from files.  their pages needn't be resident to hold
+  // data, unlike the anonymous rest of the memory.
+  std::vector<std::pair<reg_t, size_t>> file_ranges;
+  bool file_backed(reg_t addr, size_t len);
+  void map_image(const char* file);
+  void clear();
+};
+
+#endif
@@ -0,0 +1,86 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_EVENTS_H
+#define _RISCV_EVENTS_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+// things for the simulator to do at points in simulated time.  events due
+// at the same time run in the order they were scheduled.  events may be
+// scheduled from any thread, such as a device's on a worker hart thread;
+// they are handed over under a lock and merged into the queue by the
+// thread that runs them.
+class event_queue_t
+{
+ public:
+  typedef std::function<void()> action_t;
+
+  event_queue_t() : seq(0), pending(false) {}
+
+  void schedule(uint64_t when, const action_t& action)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    incoming.push_back(event_t{when, 0, action});
+    pending.store(true, std::memory_order_relaxed);
+  }
+
+  // when the next event is due, or UINT64_MAX if there are none
+  uint64_t next()
+  {
+    merge();
+    return q.empty() ? UINT64_MAX : q.top().when;
+  }
+
+  // run every event due by now, including any they schedule
+  void run(uint64_t now)
+  {
+    while (next() <= now)
+    {
+      action_t action = q.top().action;
+      q.pop();
+      action();
+    }
+  }
+
+ private:
+  struct event_t
+  {
+    uint64_t when;
+    uint64_t seq;
+    action_t action;
+
+    bool operator>(const event_t& e) const
+    {
+      return when != e.when ? when > e.when : seq > e.seq;
+    }
+  };
+
+  std::priority_queue<event_t, std::vector<event_t>, std::greater<event_t>> q;
+  uint64_t seq;
+
+  std::mutex lock;
+  std::vector<event_t> incoming;
+  std::atomic<bool> pending; // incoming may be nonempty
+
+  void merge()
+  {
+    if (!pending.load(std::memory_order_relaxed))
+      return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < incoming.size(); i++)
+    {
+      incoming[i].seq = seq++;
+      q.push(incoming[i]);
+    }
+    incoming.clear();
+    pending.store(false, std::memory_order_relaxed);
+  }
+};
+
+#endif
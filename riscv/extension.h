@@ -6,6 +6,8 @@
 #include <vector>
 #include <functional>
 
+class checkpoint_t;
+
 class extension_t
 {
  public:
@@ -14,6 +16,8 @@ class extension_t
   virtual const char* name() = 0;
   virtual void reset() {};
   virtual void set_debug(bool value) {};
+  // save or restore any architectural state the extension keeps
+  virtual void checkpoint(checkpoint_t& ckpt) {};
   virtual ~extension_t();
 
   void set_processor(processor_t* _p) { p = _p; }
@@ -0,0 +1,54 @@
+// See LICENSE for license details.
+
+#include "histogram.h"
+#include <algorithm>
+
+histogram_t::histogram_t()
+  : used(0)
+{
+  entry_t empty = {EMPTY, 0};
+  table.resize(1024, empty);
+}
+
+void histogram_t::insert(size_t idx, reg_t pc)
+{
+  table[idx].pc = pc;
+  table[idx].count = 1;
+
+  // keep the table at most half full, so probe sequences stay short
+  if (++used * 2 <= table.size())
+    return;
+
+  entry_t empty = {EMPTY, 0};
+  std::vector<entry_t> old(table.size() * 2, empty);
+  old.swap(table);
+
+  size_t mask = table.size() - 1;
+  for (size_t i = 0; i < old.size(); i++)
+  {
+    if (old[i].pc == EMPTY)
+      continue;
+    size_t j = hash(old[i].pc) & mask;
+    while (table[j].pc != EMPTY)
+      j = (j + 1) & mask;
+    table[j] = old[i];
+  }
+}
+
+void histogram_t::write(FILE* f, uint64_t id, uint64_t period)
+{
+  std::vector<entry_t> entries;
+  for (size_t i = 0; i < table.size(); i++)
+    if (table[i].pc != EMPTY)
+      entries.push_back(table[i]);
+  std::sort(entries.begin(), entries.end(),
+            [](const entry_t& a, const entry_t& b) { return a.pc < b.pc; });
+
+  uint64_t header[] = {id, period, entries.size()};
+  fwrite(header, sizeof(header), 1, f);
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    uint64_t pair[] = {entries[i].pc, entries[i].count};
+    fwrite(pair, sizeof(pair), 1, f);
+  }
+}
@@ -0,0 +1,63 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_HISTOGRAM_H
+#define _RISCV_HISTOGRAM_H
+
+#include "decode.h"
+#include <cstdio>
+#include <vector>
+
+// counts how many times each PC was sampled, in an open-addressing hash
+// table with linear probing.  each hart has its own, so no locking is
+// needed.
+//
+// histograms are written out as a sequence of host-endian 64-bit words:
+// the magic number HISTOGRAM_MAGIC, the version, and the number of harts;
+// then for each hart, its id, the sampling period, the number of PCs, and
+// that many (pc, count) pairs, sorted by PC.
+class histogram_t
+{
+ public:
+  static const uint64_t HISTOGRAM_MAGIC = 0x545348454b495053; // "SPIKEHST"
+  static const uint64_t HISTOGRAM_VERSION = 1;
+
+  histogram_t();
+
+  void record(reg_t pc)
+  {
+    size_t mask = table.size() - 1;
+    for (size_t i = hash(pc) & mask; ; i = (i + 1) & mask)
+    {
+      if (likely(table[i].pc == pc))
+      {
+        table[i].count++;
+        return;
+      }
+      if (table[i].pc == EMPTY)
+      {
+        insert(i, pc);
+        return;
+      }
+    }
+  }
+
+  size_t size() { return used; }
+  void write(FILE* f, uint64_t id, uint64_t period);
+
+ private:
+  static const reg_t EMPTY = -1; // PCs are at least 2-byte aligned
+
+  struct entry_t
+  {
+    reg_t pc;
+    uint64_t count;
+  };
+
+  std::vector<entry_t> table;
+  size_t used;
+
+  static size_t hash(reg_t pc) { return (pc >> 1) * 0x9e3779b97f4a7c15ULL >> 20; }
+  void insert(size_t idx, reg_t pc);
+};
+
+#endif
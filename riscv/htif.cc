@@ -3,17 +3,61 @@
 #include "htif.h"
 #include "sim.h"
 #include "encoding.h"
-#include <unistd.h>
-#include <stdexcept>
 #include <stdlib.h>
-#include <errno.h>
-#include <assert.h>
-#include <stddef.h>
-#include <poll.h>
+#include <string.h>
 
-htif_isasim_t::htif_isasim_t(sim_t* _sim, const std::vector<std::string>& args)
-  : htif_pthread_t(args), sim(_sim), reset(true), seqno(1)
+htif_isasim_t::htif_isasim_t(sim_t* _sim, const std::vector<std::string>& args, bool resume)
+  : htif_t(args), sim(_sim), reset(true), resume(resume), preloaded(false),
+    entry(0), idle(false),
+    host_done(false), host_turn(false), abandoned(false)
 {
+  host = std::thread(&htif_isasim_t::host_main, this);
+}
+
+htif_isasim_t::~htif_isasim_t()
+{
+  // a front-end that hasn't finished (say, if the simulation is torn down
+  // before the program exits) is unwound from where it is parked
+  {
+    std::lock_guard<std::mutex> l(lock);
+    abandoned = true;
+    host_turn = true;
+    cond.notify_all();
+  }
+  host.join();
+}
+
+// thrown on the front-end's thread to unwind it once it's abandoned
+struct htif_abandoned_t {};
+
+void htif_isasim_t::host_main()
+{
+  {
+    std::unique_lock<std::mutex> l(lock);
+    cond.wait(l, [&]{ return host_turn; });
+  }
+
+  try {
+    if (!abandoned)
+      run();
+  } catch (htif_abandoned_t&) {
+  }
+
+  std::lock_guard<std::mutex> l(lock);
+  host_done = true;
+  host_turn = false;
+  cond.notify_all();
+}
+
+// called on the front-end's thread to let the harts run
+void htif_isasim_t::yield()
+{
+  std::unique_lock<std::mutex> l(lock);
+  host_turn = false;
+  cond.notify_all();
+  cond.wait(l, [&]{ return host_turn; });
+  if (abandoned)
+    throw htif_abandoned_t();
 }
 
 bool htif_isasim_t::tick()
@@ -21,104 +65,120 @@ bool htif_isasim_t::tick()
   if (done())
     return false;
 
-  do tick_once(); while (reset);
+  std::unique_lock<std::mutex> l(lock);
+  host_turn = true;
+  cond.notify_all();
+  cond.wait(l, [&]{ return !host_turn; });
 
   return true;
 }
 
-void htif_isasim_t::tick_once()
+// the host address of len bytes at taddr, or NULL if they aren't all RAM
+char* htif_isasim_t::ram(addr_t taddr, size_t len)
+{
+  char* p = sim->addr_to_mem(taddr);
+  return p && sim->addr_to_mem(taddr + len - 1) == p + len - 1 ? p : NULL;
+}
+
+void htif_isasim_t::read_chunk(addr_t taddr, size_t len, void* dst)
+{
+  if (char* p = ram(taddr, len))
+    memcpy(dst, p, len);
+  else for (size_t i = 0; i < len; i += HTIF_DATA_ALIGN)
+  {
+    uint64_t x = sim->debug_mmu->load_uint64(taddr + i);
+    memcpy((char*)dst + i, &x, sizeof(x));
+  }
+}
+
+void htif_isasim_t::write_chunk(addr_t taddr, size_t len, const void* src)
+{
+  if ((resume || preloaded) && reset)
+    return;
+
+  if (char* p = ram(taddr, len))
+    memcpy(p, src, len);
+  else for (size_t i = 0; i < len; i += HTIF_DATA_ALIGN)
+  {
+    uint64_t x;
+    memcpy(&x, (const char*)src + i, sizeof(x));
+    sim->debug_mmu->store_uint64(taddr + i, x);
+  }
+}
+
+reg_t htif_isasim_t::read_cr(uint32_t coreid, uint16_t regnum)
 {
-  packet_header_t hdr;
-  recv(&hdr, sizeof(hdr));
+  return access_cr(coreid, regnum, false, 0);
+}
 
-  char buf[hdr.get_packet_size()];
-  memcpy(buf, &hdr, sizeof(hdr));
-  recv(buf + sizeof(hdr), hdr.get_payload_size());
-  packet_t p(buf);
+reg_t htif_isasim_t::write_cr(uint32_t coreid, uint16_t regnum, reg_t val)
+{
+  return access_cr(coreid, regnum, true, val);
+}
 
-  assert(hdr.seqno == seqno);
+reg_t htif_isasim_t::access_cr(uint32_t coreid, uint16_t regnum, bool write, reg_t new_val)
+{
+  coreid &= SCR_COREID;
+  if (coreid == SCR_COREID)
+    return sim->get_scr(regnum);
 
-  switch (hdr.cmd)
+  processor_t* proc = sim->get_core(coreid);
+  reg_t old_val;
+
+  switch (regnum)
   {
-    case HTIF_CMD_READ_MEM:
-    {
-      packet_header_t ack(HTIF_CMD_ACK, seqno, hdr.data_size, 0);
-      send(&ack, sizeof(ack));
-
-      uint64_t buf[hdr.data_size];
-      for (size_t i = 0; i < hdr.data_size; i++)
-        buf[i] = sim->debug_mmu->load_uint64((hdr.addr+i)*HTIF_DATA_ALIGN);
-      send(buf, hdr.data_size * sizeof(buf[0]));
-      break;
-    }
-    case HTIF_CMD_WRITE_MEM:
-    {
-      const uint64_t* buf = (const uint64_t*)p.get_payload();
-      for (size_t i = 0; i < hdr.data_size; i++)
-        sim->debug_mmu->store_uint64((hdr.addr+i)*HTIF_DATA_ALIGN, buf[i]);
-
-      packet_header_t ack(HTIF_CMD_ACK, seqno, 0, 0);
-      send(&ack, sizeof(ack));
-      break;
-    }
-    case HTIF_CMD_READ_CONTROL_REG:
-    case HTIF_CMD_WRITE_CONTROL_REG:
-    {
-      assert(hdr.data_size == 1);
-      reg_t coreid = hdr.addr >> 20;
-      reg_t regno = hdr.addr & ((1<<20)-1);
-      uint64_t old_val, new_val = 0 /* shut up gcc */;
-
-      packet_header_t ack(HTIF_CMD_ACK, seqno, 1, 0);
-      send(&ack, sizeof(ack));
-
-      if (coreid == 0xFFFFF) // system control register space
+    case CSR_MTOHOST:
+      // the front-end polls each hart's tohost in turn; once a whole round
+      // has found them empty, the harts get to run
+      if (coreid == 0)
       {
-        uint64_t scr = sim->get_scr(regno);
-        send(&scr, sizeof(scr));
-        break;
+        if (idle && !reset)
+          yield();
+        idle = true;
       }
 
-      processor_t* proc = sim->get_core(coreid);
-      bool write = hdr.cmd == HTIF_CMD_WRITE_CONTROL_REG;
+      old_val = proc->get_state()->tohost;
       if (write)
-        memcpy(&new_val, p.get_payload(), sizeof(new_val));
-
-      switch (regno)
+        proc->get_state()->tohost = new_val;
+      // the fork server's marker is hidden from the front-end
+      if (old_val != 0 && old_val == sim->fork_marker)
       {
-        case CSR_MTOHOST:
-          old_val = proc->get_state()->tohost;
-          if (write)
-            proc->get_state()->tohost = new_val;
-          break;
-        case CSR_MFROMHOST:
-          old_val = proc->get_state()->fromhost;
-          if (write && old_val == 0)
-            proc->get_state()->fromhost = new_val;
-          break;
-        case CSR_MRESET:
-          old_val = !proc->running();
-          if (write)
-          {
-            reset = reset & (new_val & 1);
-            proc->reset(new_val & 1);
-          }
-          break;
-        default:
-          abort();
+        sim->fork_pending = true;
+        sim->fork_hart = coreid;
+        old_val = 0;
+      }
+      if (old_val != 0)
+        idle = false;
+      break;
+    case CSR_MFROMHOST:
+      old_val = proc->get_state()->fromhost;
+      if (write && old_val == 0)
+        proc->get_state()->fromhost = new_val;
+      break;
+    case CSR_MRESET:
+      old_val = !proc->running();
+      if (write)
+      {
+        reset = reset & (new_val & 1);
+        if (!resume)
+        {
+          proc->reset(new_val & 1);
+          if (preloaded && old_val && !(new_val & 1))
+            proc->get_state()->pc = entry;
+        }
       }
-
-      send(&old_val, sizeof(old_val));
       break;
-    }
     default:
       abort();
   }
-  seqno++;
+
+  return old_val;
 }
 
 bool htif_isasim_t::done()
 {
+  if (host_done)
+    return true;
   if (reset)
     return false;
   return !sim->running();
@@ -3,29 +3,73 @@
 #ifndef _HTIF_H
 #define _HTIF_H
 
-#include <fesvr/htif_pthread.h>
+#include <fesvr/htif.h>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
 
 class sim_t;
-struct packet;
 
 // this class implements the host-target interface for program loading, etc.
-// a simpler implementation would implement the high-level interface
-// (read/write cr, read/write chunk) directly, but we implement the lower-
-// level serialized interface to be more similar to real target machines.
+// rather than serializing the front-end's requests into packets, it
+// implements the high-level interface directly: memory is copied straight
+// into guest RAM, and control registers are plain function calls.
+//
+// the front-end runs on its own thread, but only while the simulation is
+// stopped in tick(), so it may touch the harts and memory freely.  it
+// hands control back once a round of polling the harts finds nothing to
+// do, so there is one handoff per round rather than one per request.
 
-class htif_isasim_t : public htif_pthread_t
+class htif_isasim_t : public htif_t
 {
 public:
-  htif_isasim_t(sim_t* _sim, const std::vector<std::string>& args);
+  // if resume is set, the harts are already running the program, so the
+  // front-end's attempts to reset them and load the program are ignored
+  htif_isasim_t(sim_t* _sim, const std::vector<std::string>& args, bool resume = false);
+  ~htif_isasim_t();
   bool tick();
   bool done();
 
+  // the simulator has loaded the program already, so the front-end's copy
+  // is ignored, and the harts leave reset at entry
+  void set_entry(reg_t entry) { preloaded = true; this->entry = entry; }
+
+  reg_t read_cr(uint32_t coreid, uint16_t regnum);
+  reg_t write_cr(uint32_t coreid, uint16_t regnum, reg_t val);
+
+protected:
+  void read_chunk(addr_t taddr, size_t len, void* dst);
+  void write_chunk(addr_t taddr, size_t len, const void* src);
+  size_t chunk_align() { return HTIF_DATA_ALIGN; }
+  size_t chunk_max_size() { return CHUNK_MAX_SIZE; }
+
+  // the serialized interface isn't used
+  ssize_t read(void* buf, size_t max_size) { abort(); }
+  ssize_t write(const void* buf, size_t size) { abort(); }
+
 private:
+  static const size_t CHUNK_MAX_SIZE = 1 << 20;
+  static const uint32_t SCR_COREID = 0xFFFFF; // system control register space
+
   sim_t* sim;
   bool reset;
-  uint8_t seqno;
+  bool resume;
+  bool preloaded;
+  reg_t entry;
+  bool idle;      // the current polling round has found nothing to do
+  bool host_done; // the front-end has returned
+
+  std::thread host;
+  std::mutex lock;
+  std::condition_variable cond;
+  bool host_turn;
+  bool abandoned;
 
-  void tick_once();
+  void host_main();
+  void yield();
+  char* ram(addr_t taddr, size_t len);
+  reg_t access_cr(uint32_t coreid, uint16_t regnum, bool write, reg_t new_val);
 };
 
 #endif
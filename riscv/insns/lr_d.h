@@ -1,4 +1,6 @@
 require_extension('A');
 require_rv64;
+reg_t v = MMU.load_int64(RS1);
 p->get_state()->load_reservation = RS1;
-WRITE_RD(MMU.load_int64(RS1));
+p->get_state()->load_reservation_value = v;
+WRITE_RD(v);
@@ -1,3 +1,5 @@
 require_extension('A');
+reg_t v = MMU.load_int32(RS1);
 p->get_state()->load_reservation = RS1;
-WRITE_RD(MMU.load_int32(RS1));
+p->get_state()->load_reservation_value = v;
+WRITE_RD(v);
@@ -1,9 +1,14 @@
 require_extension('A');
 require_rv64;
-if (RS1 == p->get_state()->load_reservation)
+if (RS1 == p->get_state()->load_reservation &&
+    MMU.store_conditional_uint64(RS1, p->get_state()->load_reservation_value, RS2))
 {
-  MMU.store_uint64(RS1, RS2);
   WRITE_RD(0);
+  p->store_conditional_done(true);
 }
 else
+{
   WRITE_RD(1);
+  p->store_conditional_done(false);
+}
+p->yield_load_reservation();
@@ -1,8 +1,13 @@
 require_extension('A');
-if (RS1 == p->get_state()->load_reservation)
+if (RS1 == p->get_state()->load_reservation &&
+    MMU.store_conditional_uint32(RS1, p->get_state()->load_reservation_value, RS2))
 {
-  MMU.store_uint32(RS1, RS2);
   WRITE_RD(0);
+  p->store_conditional_done(true);
 }
 else
+{
   WRITE_RD(1);
+  p->store_conditional_done(false);
+}
+p->yield_load_reservation();
@@ -1 +1 @@
-// nop
+p->wait_for_interrupt();
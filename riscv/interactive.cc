@@ -79,6 +79,7 @@ void sim_t::interactive()
     funcs["str"] = &sim_t::interactive_str;
     funcs["until"] = &sim_t::interactive_until;
     funcs["while"] = &sim_t::interactive_until;
+    funcs["stats"] = &sim_t::interactive_stats;
     funcs["q"] = &sim_t::interactive_quit;
 
     try
@@ -110,6 +111,22 @@ void sim_t::interactive_run(const std::string& cmd, const std::vector<std::strin
     step(1);
 }
 
+void sim_t::interactive_stats(const std::string& cmd, const std::vector<std::string>& args)
+{
+  if (args.size() > 1)
+    throw trap_illegal_instruction();
+
+  if (args.size() == 1)
+  {
+    size_t p = atoi(args[0].c_str());
+    if (p >= num_cores())
+      throw trap_illegal_instruction();
+    print_counters(p);
+  }
+  else for (size_t i = 0; i < num_cores(); i++)
+    print_counters(i);
+}
+
 void sim_t::interactive_quit(const std::string& cmd, const std::vector<std::string>& args)
 {
   exit(0);
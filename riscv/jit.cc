@@ -0,0 +1,586 @@
+// See LICENSE for license details.
+
+#include "jit.h"
+#include "processor.h"
+#include "mmu.h"
+#include "sim.h"
+#include "trap.h"
+#include "disasm.h"
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+void store_log_t::trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc)
+{
+  if (!active || !store)
+    return;
+
+  entry_t e = {addr, bytes, 0, 0};
+  memcpy(&e.old_data, sim->addr_to_mem(addr), bytes);
+  log.push_back(e);
+}
+
+void store_log_t::begin()
+{
+  log.clear();
+  active = true;
+}
+
+std::vector<store_log_t::entry_t> store_log_t::end(bool undo)
+{
+  active = false;
+
+  for (auto it = log.begin(); it != log.end(); ++it)
+    memcpy(&it->new_data, sim->addr_to_mem(it->addr), it->bytes);
+
+  if (undo)
+    for (auto it = log.rbegin(); it != log.rend(); ++it)
+      memcpy(sim->addr_to_mem(it->addr), &it->old_data, it->bytes);
+
+  return log;
+}
+
+// run an instruction through its interpreter handler on behalf of compiled
+// code.  traps can't unwind through the compiled code, so they are caught
+// here and rethrown once the compiled code has returned.
+reg_t jit_call(jit_ctx_t* ctx, insn_func_t func, insn_bits_t bits,
+               reg_t pc, reg_t index)
+{
+  try {
+    return func(ctx->proc, insn_t(bits), pc);
+  } catch (...) {
+    ctx->jit->trap = std::current_exception();
+    ctx->pc = pc;
+    ctx->retired = index;
+    ctx->trapped = 1;
+    return 0;
+  }
+}
+
+typedef void (*jit_func_t)(jit_ctx_t*);
+
+#if defined(__x86_64__)
+
+#define JIT_INSNS(f) \
+  f(add) f(sub) f(and) f(or) f(xor) f(slt) f(sltu) f(sll) f(srl) f(sra) \
+  f(addi) f(slti) f(sltiu) f(xori) f(ori) f(andi) f(slli) f(srli) f(srai) \
+  f(lui) f(auipc) f(addw) f(subw) f(sllw) f(srlw) f(sraw) \
+  f(addiw) f(slliw) f(srliw) f(sraiw) f(mul) f(mulw) \
+  f(beq) f(bne) f(blt) f(bge) f(bltu) f(bgeu) f(jal) f(jalr)
+
+#define DECLARE_JIT_INSN(name) extern reg_t rv64_##name(processor_t*, insn_t, reg_t);
+JIT_INSNS(DECLARE_JIT_INSN)
+#undef DECLARE_JIT_INSN
+
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RSI = 6, RDI = 7, R8 = 8, R12 = 12 };
+
+// x86 condition codes
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+// ALU opcodes (op r, r/m) and the matching group-1 /digit for immediates
+enum { OP_ADD = 0x03, OP_OR = 0x0b, OP_AND = 0x23, OP_SUB = 0x2b, OP_XOR = 0x33, OP_CMP = 0x3b };
+enum { IMM_ADD = 0, IMM_OR = 1, IMM_AND = 4, IMM_SUB = 5, IMM_XOR = 6, IMM_CMP = 7 };
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+// a minimal x86-64 assembler, covering just what the translator emits.
+// memory operands are always [base + disp32].
+class x86_emitter_t
+{
+ public:
+  x86_emitter_t(uint8_t* buf) : p(buf) {}
+  uint8_t* pos() { return p; }
+
+  void byte(uint8_t x) { *p++ = x; }
+  void u32(uint32_t x) { memcpy(p, &x, sizeof(x)); p += sizeof(x); }
+  void u64(uint64_t x) { memcpy(p, &x, sizeof(x)); p += sizeof(x); }
+
+  void rex(bool w, int reg, int rm)
+  {
+    uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (r != 0x40)
+      byte(r);
+  }
+  void modrm_mem(int reg, int base, int32_t disp)
+  {
+    byte(0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+      byte(0x24);
+    u32(disp);
+  }
+  void modrm_reg(int reg, int rm) { byte(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+
+  // op reg, [base + disp]
+  void op_mem(bool w, uint8_t op, int reg, int base, int32_t disp)
+  {
+    rex(w, reg, base); byte(op); modrm_mem(reg, base, disp);
+  }
+  // op reg, rm
+  void op_reg(bool w, uint8_t op, int reg, int rm)
+  {
+    rex(w, reg, rm); byte(op); modrm_reg(reg, rm);
+  }
+
+  void load(int reg, int base, int32_t disp) { op_mem(true, 0x8b, reg, base, disp); }
+  void store(int reg, int base, int32_t disp) { op_mem(true, 0x89, reg, base, disp); }
+  void mov(int dst, int src) { op_reg(true, 0x8b, dst, src); }
+  void mov_imm(int reg, uint64_t imm) { rex(true, 0, reg); byte(0xb8 | (reg & 7)); u64(imm); }
+
+  void alu_imm(bool w, int digit, int rm, int32_t imm)
+  {
+    rex(w, 0, rm); byte(0x81); modrm_reg(digit, rm); u32(imm);
+  }
+  void shift_imm(bool w, int digit, int rm, uint8_t imm)
+  {
+    rex(w, 0, rm); byte(0xc1); modrm_reg(digit, rm); byte(imm);
+  }
+  void shift_cl(bool w, int digit, int rm) { rex(w, 0, rm); byte(0xd3); modrm_reg(digit, rm); }
+  void imul_mem(bool w, int reg, int base, int32_t disp)
+  {
+    rex(w, reg, base); byte(0x0f); byte(0xaf); modrm_mem(reg, base, disp);
+  }
+
+  // rax = (condition) ? 1 : 0
+  void setcc_rax(int cc) { byte(0x0f); byte(0x90 | cc); byte(0xc0); byte(0x0f); byte(0xb6); byte(0xc0); }
+  void movsxd(int reg, int rm) { op_reg(true, 0x63, reg, rm); }
+  void cmov(int cc, int reg, int rm) { rex(true, reg, rm); byte(0x0f); byte(0x40 | cc); modrm_reg(reg, rm); }
+
+  void push(int reg) { rex(false, 0, reg); byte(0x50 | (reg & 7)); }
+  void pop(int reg) { rex(false, 0, reg); byte(0x58 | (reg & 7)); }
+  void call(int reg) { rex(false, 0, reg); byte(0xff); modrm_reg(2, reg); }
+  void ret() { byte(0xc3); }
+
+  // cmp qword [base + disp], imm8
+  void cmp_mem_imm8(int base, int32_t disp, int8_t imm)
+  {
+    rex(true, 0, base); byte(0x83); modrm_mem(IMM_CMP, base, disp); byte(imm);
+  }
+
+  // conditional jump to a label that is bound later
+  uint8_t* jcc(int cc) { byte(0x0f); byte(0x80 | cc); u32(0); return p - 4; }
+  void bind(uint8_t* at, uint8_t* target)
+  {
+    int32_t rel = target - (at + 4);
+    memcpy(at, &rel, sizeof(rel));
+  }
+
+ private:
+  uint8_t* p;
+};
+
+// the largest translation of a single instruction, in bytes
+static const size_t MAX_INSN_CODE = 96;
+
+bool jit_t::supported()
+{
+  return true;
+}
+
+jit_t::jit_t(processor_t* proc, bool lockstep)
+  : proc(proc), lockstep(lockstep), code_used(0), epoch(0), stores(proc->sim)
+{
+  code = (uint8_t*)mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+  {
+    perror("jit: mmap");
+    abort();
+  }
+
+  if (lockstep)
+    proc->get_mmu()->register_memtracer(&stores);
+}
+
+jit_t::~jit_t()
+{
+  munmap(code, CODE_SIZE);
+}
+
+bool jit_t::compile(block_t* block, reg_t pc)
+{
+  size_t worst = 64 + block->length * MAX_INSN_CODE;
+  if (code_used + worst > CODE_SIZE)
+  {
+    // out of space: drop all translations and start over
+    code_used = 0;
+    epoch++;
+  }
+
+  // inline translations assume RV64 semantics
+  bool inline_ok = proc->xlen == 64;
+  bool rvc = proc->supports_extension('C');
+
+  uint8_t* start = code + code_used;
+  x86_emitter_t e(start);
+  std::vector<uint8_t*> exits;
+
+  // rbx holds the integer register file; r12 holds the context
+  e.push(RBX);
+  e.push(R12);
+  e.alu_imm(true, IMM_SUB, RSP, 8); // keep the stack 16-byte aligned for calls
+  e.mov(R12, RDI);
+  e.load(RBX, R12, offsetof(jit_ctx_t, xpr));
+
+  #define X(r) int32_t(8 * (r))
+
+  for (size_t i = 0; i < block->length; i++)
+  {
+    insn_fetch_t f = block->insns[i];
+    insn_t insn = f.insn;
+    reg_t rd = insn.rd(), rs1 = insn.rs1(), rs2 = insn.rs2();
+    int32_t imm = insn.i_imm();
+    uint8_t shamt = insn.i_imm() & 0x3f;
+    bool last = i == block->length - 1;
+    bool control = false; // the translation leaves the next pc in rax
+    bool done = inline_ok;
+
+    // write rax to rd, sign-extending 32-bit results
+    auto write_rd = [&](bool w) {
+      if (!w)
+        e.movsxd(RAX, RAX);
+      e.store(RAX, RBX, X(rd));
+    };
+
+    #define R_TYPE(name, w, op) \
+      else if (f.func == rv64_##name) { \
+        if (rd) { e.op_mem(w, 0x8b, RAX, RBX, X(rs1)); e.op_mem(w, op, RAX, RBX, X(rs2)); \
+                  write_rd(w); } }
+    #define I_TYPE(name, w, digit) \
+      else if (f.func == rv64_##name) { \
+        if (rd) { e.op_mem(w, 0x8b, RAX, RBX, X(rs1)); e.alu_imm(w, digit, RAX, imm); \
+                  write_rd(w); } }
+    #define SHIFT_R(name, w, digit) \
+      else if (f.func == rv64_##name) { \
+        if (rd) { e.load(RCX, RBX, X(rs2)); e.op_mem(w, 0x8b, RAX, RBX, X(rs1)); \
+                  e.shift_cl(w, digit, RAX); write_rd(w); } }
+    #define SHIFT_I(name, w, digit) \
+      else if (f.func == rv64_##name && (w || !(shamt & 0x20))) { \
+        if (rd) { e.op_mem(w, 0x8b, RAX, RBX, X(rs1)); e.shift_imm(w, digit, RAX, shamt); \
+                  write_rd(w); } }
+    #define SET_R(name, cc) \
+      else if (f.func == rv64_##name) { \
+        if (rd) { e.load(RDX, RBX, X(rs1)); e.op_mem(true, OP_CMP, RDX, RBX, X(rs2)); \
+                  e.setcc_rax(cc); e.store(RAX, RBX, X(rd)); } }
+    #define SET_I(name, cc) \
+      else if (f.func == rv64_##name) { \
+        if (rd) { e.load(RDX, RBX, X(rs1)); e.alu_imm(true, IMM_CMP, RDX, imm); \
+                  e.setcc_rax(cc); e.store(RAX, RBX, X(rd)); } }
+    #define BRANCH(name, cc) \
+      else if (f.func == rv64_##name && (rvc || !((pc + insn.sb_imm()) & 2))) { \
+        e.load(RDX, RBX, X(rs1)); e.op_mem(true, OP_CMP, RDX, RBX, X(rs2)); \
+        e.mov_imm(RAX, pc + 4); e.mov_imm(RCX, pc + insn.sb_imm()); \
+        e.cmov(cc, RAX, RCX); control = true; }
+
+    if (!inline_ok) ;
+    R_TYPE(add, true, OP_ADD)
+    R_TYPE(sub, true, OP_SUB)
+    R_TYPE(and, true, OP_AND)
+    R_TYPE(or, true, OP_OR)
+    R_TYPE(xor, true, OP_XOR)
+    R_TYPE(addw, false, OP_ADD)
+    R_TYPE(subw, false, OP_SUB)
+    I_TYPE(addi, true, IMM_ADD)
+    I_TYPE(xori, true, IMM_XOR)
+    I_TYPE(ori, true, IMM_OR)
+    I_TYPE(andi, true, IMM_AND)
+    I_TYPE(addiw, false, IMM_ADD)
+    SHIFT_R(sll, true, SHIFT_SHL)
+    SHIFT_R(srl, true, SHIFT_SHR)
+    SHIFT_R(sra, true, SHIFT_SAR)
+    SHIFT_R(sllw, false, SHIFT_SHL)
+    SHIFT_R(srlw, false, SHIFT_SHR)
+    SHIFT_R(sraw, false, SHIFT_SAR)
+    SHIFT_I(slli, true, SHIFT_SHL)
+    SHIFT_I(srli, true, SHIFT_SHR)
+    SHIFT_I(srai, true, SHIFT_SAR)
+    SHIFT_I(slliw, false, SHIFT_SHL)
+    SHIFT_I(srliw, false, SHIFT_SHR)
+    SHIFT_I(sraiw, false, SHIFT_SAR)
+    SET_R(slt, CC_L)
+    SET_R(sltu, CC_B)
+    SET_I(slti, CC_L)
+    SET_I(sltiu, CC_B)
+    BRANCH(beq, CC_E)
+    BRANCH(bne, CC_NE)
+    BRANCH(blt, CC_L)
+    BRANCH(bge, CC_GE)
+    BRANCH(bltu, CC_B)
+    BRANCH(bgeu, CC_AE)
+    else if ((f.func == rv64_mul || f.func == rv64_mulw) && proc->supports_extension('M'))
+    {
+      bool w = f.func == rv64_mul;
+      if (rd)
+      {
+        e.op_mem(w, 0x8b, RAX, RBX, X(rs1));
+        e.imul_mem(w, RAX, RBX, X(rs2));
+        write_rd(w);
+      }
+    }
+    else if (f.func == rv64_lui || f.func == rv64_auipc)
+    {
+      if (rd)
+      {
+        e.mov_imm(RAX, insn.u_imm() + (f.func == rv64_auipc ? pc : 0));
+        e.store(RAX, RBX, X(rd));
+      }
+    }
+    else if (f.func == rv64_jal && (rvc || !((pc + insn.uj_imm()) & 2)))
+    {
+      if (rd)
+      {
+        e.mov_imm(RAX, pc + 4);
+        e.store(RAX, RBX, X(rd));
+      }
+      e.mov_imm(RAX, pc + insn.uj_imm());
+      control = true;
+    }
+    else if (f.func == rv64_jalr && rvc)
+    {
+      e.load(RAX, RBX, X(rs1));
+      e.alu_imm(true, IMM_ADD, RAX, imm);
+      e.alu_imm(true, IMM_AND, RAX, -2);
+      if (rd)
+      {
+        e.mov_imm(RCX, pc + 4);
+        e.store(RCX, RBX, X(rd));
+      }
+      control = true;
+    }
+    else
+      done = false;
+
+    #undef R_TYPE
+    #undef I_TYPE
+    #undef SHIFT_R
+    #undef SHIFT_I
+    #undef SET_R
+    #undef SET_I
+    #undef BRANCH
+
+    if (!done)
+    {
+      // hand the instruction to the interpreter
+      e.mov(RDI, R12);
+      e.mov_imm(RSI, (uint64_t)f.func);
+      e.mov_imm(RDX, insn.bits());
+      e.mov_imm(RCX, pc);
+      e.mov_imm(R8, i);
+      e.mov_imm(RAX, (uint64_t)&jit_call);
+      e.call(RAX);
+      e.cmp_mem_imm8(R12, offsetof(jit_ctx_t, trapped), 0);
+      exits.push_back(e.jcc(CC_NE));
+      control = true;
+    }
+
+    pc += insn.length();
+    if (last && !control)
+      e.mov_imm(RAX, pc);
+  }
+
+  #undef X
+
+  e.store(RAX, R12, offsetof(jit_ctx_t, pc));
+  e.mov_imm(RAX, block->length);
+  e.store(RAX, R12, offsetof(jit_ctx_t, retired));
+
+  for (size_t i = 0; i < exits.size(); i++)
+    e.bind(exits[i], e.pos());
+  e.alu_imm(true, IMM_ADD, RSP, 8);
+  e.pop(R12);
+  e.pop(RBX);
+  e.ret();
+
+  code_used = (e.pos() - code + 15) & -16;
+  block->jit_code = start;
+  block->jit_epoch = epoch;
+  return true;
+}
+
+#else
+
+bool jit_t::supported()
+{
+  return false;
+}
+
+jit_t::jit_t(processor_t* proc, bool lockstep)
+  : proc(proc), lockstep(lockstep), code(NULL), code_used(0), epoch(0), stores(proc->sim)
+{
+}
+
+jit_t::~jit_t()
+{
+}
+
+bool jit_t::compile(block_t* block, reg_t pc)
+{
+  return false;
+}
+
+#endif
+
+bool jit_t::execute(block_t* block, reg_t& pc, size_t& instret)
+{
+  if (unlikely(block->jit_code == NULL || block->jit_epoch != epoch))
+  {
+    if (block->jit_code != NULL)
+      block->jit_code = NULL, block->jit_hits = 0;
+    if (++block->jit_hits != HOT_THRESHOLD || !compile(block, pc))
+      return false;
+  }
+
+  if (unlikely(lockstep))
+  {
+    execute_lockstep(block, pc, instret);
+    return true;
+  }
+
+  jit_ctx_t ctx = {proc, this, (reg_t*)&proc->state.XPR, 0, 0, 0};
+  ((jit_func_t)block->jit_code)(&ctx);
+  finish(block, ctx, pc, instret);
+  return true;
+}
+
+// account for the instructions a block retired, and rethrow any trap
+void jit_t::finish(block_t* block, jit_ctx_t& ctx, reg_t& pc, size_t& instret)
+{
+  if (unlikely(ctx.trapped))
+  {
+    std::exception_ptr t = trap;
+    trap = nullptr;
+    instret += ctx.retired;
+    pc = ctx.pc;
+    std::rethrow_exception(t);
+  }
+
+  if (unlikely(ctx.pc == PC_SERIALIZE))
+  {
+    // replay the last instruction, as the interpreter would
+    reg_t last = pc;
+    for (size_t i = 0; i < block->length - 1; i++)
+      last += block->insns[i].insn.length();
+    proc->state.pc = last;
+    ctx.retired--;
+  }
+
+  instret += ctx.retired;
+  pc = ctx.pc;
+}
+
+static reg_t trap_cause(std::exception_ptr t)
+{
+  try {
+    std::rethrow_exception(t);
+  } catch (trap_t& t) {
+    return t.cause();
+  } catch (...) {
+    return -1;
+  }
+}
+
+static bool touched_device(std::exception_ptr t)
+{
+  try {
+    std::rethrow_exception(t);
+  } catch (mmio_blocked_t&) {
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
+void jit_t::execute_lockstep(block_t* block, reg_t& pc, size_t& instret)
+{
+  state_t* state = &proc->state;
+  state_t before, after;
+  memcpy(&before, state, sizeof(state_t));
+
+  // a block entered with state.serialized replays a serializing
+  // instruction, whose effects (IPIs, HTIF requests) reach beyond this
+  // hart and can't be rolled back, so it is only interpreted.  so is a
+  // block whose compiled code would touch a device.
+  bool check = !state->serialized;
+
+  // run the compiled code, then roll back its effects
+  jit_ctx_t ctx = {proc, this, (reg_t*)&state->XPR, 0, 0, 0};
+  std::vector<store_log_t::entry_t> jit_stores;
+  std::exception_ptr jit_trap;
+  if (check)
+  {
+    stores.begin();
+    proc->get_mmu()->set_mmio_blocked(true);
+    ((jit_func_t)block->jit_code)(&ctx);
+    proc->get_mmu()->set_mmio_blocked(false);
+    jit_stores = stores.end(true);
+    jit_trap = trap;
+    trap = nullptr;
+    memcpy(&after, state, sizeof(state_t));
+    memcpy(state, &before, sizeof(state_t));
+    check = !(ctx.trapped && touched_device(jit_trap));
+  }
+
+  // run the interpreter for real
+  jit_ctx_t ref = {proc, this, NULL, pc, 0, 0};
+  std::exception_ptr ref_trap;
+  stores.begin();
+  for (size_t i = 0; i < block->length; i++)
+  {
+    insn_fetch_t f = block->insns[i];
+    try {
+      ref.pc = f.func(proc, f.insn, ref.pc);
+    } catch (...) {
+      ref_trap = std::current_exception();
+      ref.trapped = 1;
+      break;
+    }
+    ref.retired++;
+  }
+  std::vector<store_log_t::entry_t> ref_stores = stores.end(false);
+
+  if (!check)
+  {
+    trap = ref_trap;
+    finish(block, ref, pc, instret);
+    return;
+  }
+
+  bool ok = ctx.trapped == ref.trapped && ctx.pc == ref.pc && ctx.retired == ref.retired;
+  if (ok && ctx.trapped)
+    ok = trap_cause(jit_trap) == trap_cause(ref_trap);
+  ok = ok && jit_stores.size() == ref_stores.size();
+  for (size_t i = 0; ok && i < jit_stores.size(); i++)
+    ok = jit_stores[i].addr == ref_stores[i].addr
+         && jit_stores[i].bytes == ref_stores[i].bytes
+         && jit_stores[i].new_data == ref_stores[i].new_data;
+  ok = ok && memcmp(&after, state, sizeof(state_t)) == 0;
+
+  if (unlikely(!ok))
+  {
+    fprintf(stderr, "jit: lockstep mismatch in block at 0x%016" PRIx64 "\n", pc);
+    disassembler_t disasm;
+    reg_t insn_pc = pc;
+    for (size_t i = 0; i < block->length; i++)
+    {
+      insn_t insn = block->insns[i].insn;
+      fprintf(stderr, "  0x%016" PRIx64 " %s\n", insn_pc, disasm.disassemble(insn).c_str());
+      insn_pc += insn.length();
+    }
+    fprintf(stderr, "  jit: pc 0x%016" PRIx64 " retired %" PRIu64 " trapped %d\n",
+            ctx.pc, ctx.retired, int(ctx.trapped));
+    fprintf(stderr, "  ref: pc 0x%016" PRIx64 " retired %" PRIu64 " trapped %d\n",
+            ref.pc, ref.retired, int(ref.trapped));
+    for (size_t r = 0; r < NXPR; r++)
+      if (after.XPR[r] != state->XPR[r])
+        fprintf(stderr, "  %-4s jit 0x%016" PRIx64 " ref 0x%016" PRIx64 "\n",
+                xpr_name[r], after.XPR[r], state->XPR[r]);
+    if (jit_stores.size() != ref_stores.size())
+      fprintf(stderr, "  jit made %zu stores, ref made %zu\n",
+              jit_stores.size(), ref_stores.size());
+    abort();
+  }
+
+  trap = ref_trap;
+  finish(block, ref, pc, instret);
+}
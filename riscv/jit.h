@@ -0,0 +1,92 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_JIT_H
+#define _RISCV_JIT_H
+
+#include "decode.h"
+#include "processor.h"
+#include "memtracer.h"
+#include <exception>
+#include <vector>
+
+struct block_t;
+class jit_t;
+
+// state shared between a compiled block and the code that runs it
+struct jit_ctx_t
+{
+  processor_t* proc;
+  jit_t* jit;
+  reg_t* xpr;
+  reg_t pc;       // next pc, or the pc of the instruction that trapped
+  reg_t retired;  // number of instructions that completed
+  reg_t trapped;
+};
+
+// records the prior contents of each stored location, so that the effects
+// of a block on memory can be rolled back.  only stores to RAM are seen.
+class store_log_t : public memtracer_t
+{
+ public:
+  struct entry_t
+  {
+    uint64_t addr;
+    size_t bytes;
+    uint64_t old_data;
+    uint64_t new_data;
+  };
+
+  store_log_t(sim_t* sim) : sim(sim), active(false) {}
+  bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch) { return store; }
+  bool needs_pc() { return false; }
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc);
+
+  void begin();
+  std::vector<entry_t> end(bool undo);
+
+ private:
+  sim_t* sim;
+  bool active;
+  std::vector<entry_t> log;
+};
+
+// this class translates hot basic blocks to x86-64 code.  simple integer
+// instructions are translated inline; the rest call their interpreter
+// handlers, so memory accesses still go through mmu_t::translate.
+class jit_t
+{
+ public:
+  jit_t(processor_t* proc, bool lockstep);
+  ~jit_t();
+
+  // run a block through its compiled code.  returns false if the block
+  // isn't compiled (yet), in which case it should be interpreted.
+  bool execute(block_t* block, reg_t& pc, size_t& instret);
+
+  static bool supported();
+
+ private:
+  static const size_t HOT_THRESHOLD = 64;
+  static const size_t CODE_SIZE = 16 << 20;
+
+  processor_t* proc;
+  bool lockstep;
+  uint8_t* code;
+  size_t code_used;
+  size_t epoch; // bumped whenever the code buffer is recycled
+  std::exception_ptr trap;
+
+  // run the block through both the compiled code and the interpreter,
+  // and stop the simulation if they disagree.  only effects on the hart's
+  // state and on RAM can be rolled back, so blocks that touch devices or
+  // replay a serializing instruction are interpreted unchecked.
+  store_log_t stores;
+  void execute_lockstep(block_t* block, reg_t& pc, size_t& instret);
+
+  bool compile(block_t* block, reg_t pc);
+  void finish(block_t* block, jit_ctx_t& ctx, reg_t& pc, size_t& instret);
+
+  friend reg_t jit_call(jit_ctx_t*, insn_func_t, insn_bits_t, reg_t, reg_t);
+};
+
+#endif
@@ -0,0 +1,117 @@
+// See LICENSE for license details.
+
+#include "sim.h"
+#include "htif.h"
+#include <cerrno>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+void sim_t::load_program()
+{
+  // the program is the first argument that isn't meant for the front-end
+  std::string path;
+  for (size_t i = 0; i < htif_args.size() && path.empty(); i++)
+    if (!htif_args[i].empty() && htif_args[i][0] != '+')
+      path = htif_args[i];
+  if (path.empty() || path == "none")
+    return;
+
+  // anything we can't open, such as a program the front-end finds on its
+  // search path, is left to the front-end
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < EI_NIDENT)
+  {
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    close(fd);
+    return;
+  }
+
+  const char* elf = (const char*)p;
+  reg_t entry;
+  bool ok = memcmp(elf, ELFMAG, SELFMAG) == 0;
+  if (ok && elf[EI_CLASS] == ELFCLASS64)
+    ok = load_elf<Elf64_Ehdr, Elf64_Phdr>(elf, st.st_size, fd, &entry);
+  else if (ok && elf[EI_CLASS] == ELFCLASS32)
+    ok = load_elf<Elf32_Ehdr, Elf32_Phdr>(elf, st.st_size, fd, &entry);
+  else
+    ok = false;
+
+  munmap(p, st.st_size);
+  close(fd);
+  if (ok)
+    htif->set_entry(entry);
+}
+
+// the RAM region holding len bytes at addr, or NULL if they aren't all RAM
+mem_t* sim_t::find_mem(reg_t addr, size_t len, reg_t* offset)
+{
+  for (size_t i = 0; i < mems.size(); i++)
+  {
+    *offset = addr - mems[i].first;
+    if (*offset < mems[i].second->size() && len <= mems[i].second->size() - *offset)
+      return mems[i].second;
+  }
+  return NULL;
+}
+
+template<class ehdr_t, class phdr_t>
+bool sim_t::load_elf(const char* elf, size_t size, int fd, reg_t* entry)
+{
+  const ehdr_t* eh = (const ehdr_t*)elf;
+  if (size < sizeof(ehdr_t) || eh->e_machine != EM_RISCV ||
+      eh->e_phentsize != sizeof(phdr_t) || eh->e_phoff + eh->e_phnum * sizeof(phdr_t) > size)
+    return false;
+
+  // check every segment before touching memory, so that the front-end can
+  // still load the program if it targets anything but RAM
+  const phdr_t* ph = (const phdr_t*)(elf + eh->e_phoff);
+  reg_t offset;
+  for (size_t i = 0; i < eh->e_phnum; i++)
+    if (ph[i].p_type == PT_LOAD && ph[i].p_memsz &&
+        (ph[i].p_offset + ph[i].p_filesz > size || ph[i].p_filesz > ph[i].p_memsz ||
+         !find_mem(ph[i].p_paddr, ph[i].p_memsz, &offset)))
+      return false;
+
+  size_t pgsize = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < eh->e_phnum; i++)
+  {
+    if (ph[i].p_type != PT_LOAD || !ph[i].p_memsz)
+      continue;
+
+    mem_t* m = find_mem(ph[i].p_paddr, ph[i].p_memsz, &offset);
+    char* dst = m->contents() + offset;
+    const char* src = elf + ph[i].p_offset;
+    size_t len = ph[i].p_filesz;
+
+    // the whole pages of the segment are mapped straight from the file,
+    // copy-on-write, if they line up with the pages of memory; the ends
+    // are copied
+    size_t head = (pgsize - offset % pgsize) % pgsize;
+    size_t body = len > head ? (len - head) / pgsize * pgsize : 0;
+    if (body == 0 || (offset - ph[i].p_offset) % pgsize != 0 ||
+        !m->map_file(offset + head, body, fd, ph[i].p_offset + head))
+      head = len, body = 0;
+    memcpy(dst, src, head);
+    memcpy(dst + head + body, src + head + body, len - head - body);
+    memset(dst + len, 0, ph[i].p_memsz - len);
+  }
+
+  *entry = eh->e_entry;
+  return true;
+}
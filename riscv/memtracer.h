@@ -14,7 +14,11 @@ class memtracer_t
   virtual ~memtracer_t() {}
 
   virtual bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch) = 0;
-  virtual void trace(uint64_t addr, size_t bytes, bool store, bool fetch) = 0;
+  // whether the pcs passed to trace() must be exact, which slows the
+  // simulator down
+  virtual bool needs_pc() { return true; }
+  // pc is the virtual address of the instruction making the access
+  virtual void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc) = 0;
 };
 
 class memtracer_list_t : public memtracer_t
@@ -28,10 +32,10 @@ class memtracer_list_t : public memtracer_t
         return true;
     return false;
   }
-  void trace(uint64_t addr, size_t bytes, bool store, bool fetch)
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch, uint64_t pc)
   {
     for (std::vector<memtracer_t*>::iterator it = list.begin(); it != list.end(); ++it)
-      (*it)->trace(addr, bytes, store, fetch);
+      (*it)->trace(addr, bytes, store, fetch, pc);
   }
   void hook(memtracer_t* h)
   {
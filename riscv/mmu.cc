@@ -3,67 +3,373 @@
 #include "mmu.h"
 #include "sim.h"
 #include "processor.h"
+#include "trace.h"
 
-mmu_t::mmu_t(char* _mem, size_t _memsz)
- : mem(_mem), memsz(_memsz), proc(NULL)
+mmu_t::mmu_t(sim_t* sim)
+ : sim(sim), proc(NULL), trace(NULL), mmio_blocked(false),
+   fetch_traced(false), pc_traced(false),
+   tlb_superpage_victim(0), fetch_ctx(0)
 {
-  flush_tlb();
+  memset(&counters, 0, sizeof(counters));
+  set_tlb(DEFAULT_TLB_L2_ENTRIES);
+  set_icache(DEFAULT_ICACHE_ENTRIES, 1);
 }
 
 mmu_t::~mmu_t()
 {
 }
 
+void mmu_t::set_icache(size_t entries, size_t ways)
+{
+  icache_ways = ways;
+  icache_sets_log2 = __builtin_ctzl(entries / ways);
+  icache.resize(entries);
+  block_sets_log2 = __builtin_ctzl(entries / 4);
+  blocks.resize(entries / 4);
+  flush_tlb();
+}
+
+void mmu_t::set_tlb(size_t l2_entries)
+{
+  tlb_l2.resize(l2_entries);
+  flush_tlb();
+}
+
 void mmu_t::flush_icache()
 {
-  for (size_t i = 0; i < ICACHE_ENTRIES; i++)
+  for (size_t i = 0; i < icache.size(); i++)
     icache[i].tag = -1;
+
+  flush_blocks();
+}
+
+void mmu_t::flush_blocks()
+{
+  for (size_t i = 0; i < blocks.size(); i++)
+    blocks[i].tag = -1;
+
+  code_pages.clear();
+}
+
+// whether an instruction may redirect control flow (or serialize the
+// pipeline), so that it must be the last instruction of a block
+static bool ends_block(insn_t insn)
+{
+  insn_bits_t bits = insn.bits();
+
+  if (insn.length() == 2)
+    return (bits & MASK_C_BEQZ) == MATCH_C_BEQZ
+        || (bits & MASK_C_BNEZ) == MATCH_C_BNEZ
+        || (bits & MASK_C_J) == MATCH_C_J
+        || (bits & MASK_C_JALR) == MATCH_C_JALR;
+
+  if (insn.length() != 4)
+    return true;
+
+  switch (bits & 0x7f)
+  {
+    case 0x03: // LOAD
+    case 0x07: // LOAD-FP
+    case 0x13: // OP-IMM
+    case 0x17: // AUIPC
+    case 0x1b: // OP-IMM-32
+    case 0x23: // STORE
+    case 0x27: // STORE-FP
+    case 0x2f: // AMO
+    case 0x33: // OP
+    case 0x37: // LUI
+    case 0x3b: // OP-32
+    case 0x43: // MADD
+    case 0x47: // MSUB
+    case 0x4b: // NMSUB
+    case 0x4f: // NMADD
+    case 0x53: // OP-FP
+      return false;
+    case 0x0f: // MISC-MEM: FENCE.I ends a block, FENCE doesn't
+      return (bits & MASK_FENCE_I) == MATCH_FENCE_I;
+    default: // branches, jumps, SYSTEM, and custom extensions
+      return true;
+  }
+}
+
+// whether an instruction leaves memory and the CSRs alone, so that a loop
+// of such instructions that doesn't change the registers gets nowhere
+static bool only_reads(insn_t insn)
+{
+  insn_bits_t bits = insn.bits();
+
+  if (insn.length() != 4)
+    return false;
+
+  switch (bits & 0x7f)
+  {
+    case 0x03: // LOAD
+    case 0x07: // LOAD-FP
+    case 0x13: // OP-IMM
+    case 0x17: // AUIPC
+    case 0x1b: // OP-IMM-32
+    case 0x33: // OP
+    case 0x37: // LUI
+    case 0x3b: // OP-32
+    case 0x43: // MADD
+    case 0x47: // MSUB
+    case 0x4b: // NMSUB
+    case 0x4f: // NMADD
+    case 0x53: // OP-FP
+    case 0x63: // BRANCH
+    case 0x67: // JALR
+    case 0x6f: // JAL
+      return true;
+    case 0x0f: // MISC-MEM
+      return (bits & MASK_FENCE_I) != MATCH_FENCE_I;
+    case 0x2f: // AMO: only LR
+      return (bits & MASK_LR_W) == MATCH_LR_W || (bits & MASK_LR_D) == MATCH_LR_D;
+    default: // stores, SYSTEM, and custom extensions
+      return false;
+  }
+}
+
+icache_entry_t* mmu_t::refill_icache(reg_t addr, icache_entry_t* set)
+{
+  for (size_t i = 1; i < icache_ways; i++)
+  {
+    if (set[i].tag == addr && set[i].ctx == fetch_ctx)
+    {
+      std::swap(set[0], set[i]);
+      counters.icache_hits++;
+      return &set[0];
+    }
+  }
+
+  counters.icache_misses++;
+
+  char* iaddr = (char*)translate(addr, 1, false, true);
+  insn_bits_t insn = *(uint16_t*)iaddr;
+  int length = insn_length(insn);
+
+  if (likely(length == 4)) {
+    if (likely(addr % PGSIZE < PGSIZE-2))
+      insn |= (insn_bits_t)*(int16_t*)(iaddr + 2) << 16;
+    else
+      insn |= (insn_bits_t)*(int16_t*)translate(addr + 2, 1, false, true) << 16;
+  } else if (length == 2) {
+    insn = (int16_t)insn;
+  } else if (length == 6) {
+    insn |= (insn_bits_t)*(int16_t*)translate(addr + 4, 1, false, true) << 32;
+    insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 1, false, true) << 16;
+  } else {
+    static_assert(sizeof(insn_bits_t) == 8, "insn_bits_t must be uint64_t");
+    insn |= (insn_bits_t)*(int16_t*)translate(addr + 6, 1, false, true) << 48;
+    insn |= (insn_bits_t)*(uint16_t*)translate(addr + 4, 1, false, true) << 32;
+    insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 1, false, true) << 16;
+  }
+
+  // evict the least recently used way
+  for (size_t i = icache_ways - 1; i > 0; i--)
+    set[i] = set[i-1];
+
+  insn_fetch_t fetch = {proc->decode_insn(insn), insn};
+  set[0].tag = addr;
+  set[0].ctx = fetch_ctx;
+  set[0].data = fetch;
+  return &set[0];
+}
+
+// decoded instructions stay cached when fetches are traced, so the tracer
+// is told about each fetch here, rather than when the icache is refilled
+void mmu_t::trace_fetch(reg_t addr, insn_t insn)
+{
+  reg_t paddr = sim->mem_to_addr((char*)translate(addr, 1, false, true));
+  if (tracer.interested_in_range(paddr, paddr + 1, false, true))
+    tracer.trace(paddr, insn.length(), false, true, addr);
+}
+
+block_t* mmu_t::refill_block(reg_t addr)
+{
+  insn_fetch_t fetch = load_insn(addr);
+  reg_t page = reg_t(translate(addr, 1, false, true)) >> PGSHIFT;
+
+  auto writes = code_page_writes.find(page);
+  if (unlikely(writes != code_page_writes.end() && writes->second >= MAX_CODE_PAGE_WRITES))
+  {
+    scratch_block.tag = addr;
+    scratch_block.ctx = fetch_ctx;
+    scratch_block.length = 1;
+    scratch_block.insns[0] = fetch;
+    scratch_block.read_only = false;
+    scratch_block.jit_code = NULL;
+    scratch_block.jit_hits = 0;
+    return &scratch_block;
+  }
+
+  block_t* block = &blocks[cache_index(addr, block_sets_log2)];
+  block->tag = -1;
+  block->length = 0;
+  block->read_only = true;
+  block->jit_code = NULL;
+  block->jit_hits = 0;
+
+  for (reg_t pc = addr; ; )
+  {
+    block->insns[block->length++] = fetch;
+    block->read_only &= only_reads(fetch.insn);
+    if (ends_block(fetch.insn) || block->length == block_t::MAX_INSNS)
+      break;
+
+    // blocks don't cross pages
+    pc += fetch.insn.length();
+    if ((pc ^ addr) & -PGSIZE)
+      break;
+
+    // a fetch fault ends the block; it is taken once execution gets there
+    try {
+      fetch = load_insn(pc);
+    } catch (trap_t& t) {
+      break;
+    }
+  }
+
+  block->tag = addr;
+  block->ctx = fetch_ctx;
+
+  // route stores to this page through refill_tlb, which invalidates blocks
+  code_pages.insert(page);
+  reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
+  if (tlb_store_tag[idx] == (addr >> PGSHIFT))
+    tlb_store_tag[idx] = -1;
+
+  return block;
 }
 
 void mmu_t::flush_tlb()
+{
+  for (size_t i = 0; i < tlb_l2.size(); i++)
+    tlb_l2[i].vpn = -1;
+  for (size_t i = 0; i < SUPERPAGE_TLB_ENTRIES; i++)
+    tlb_superpage[i].vbase = -1;
+  memset(walk_cache, -1, sizeof(walk_cache));
+  counters.tlb_flushes++;
+
+  switch_context();
+  flush_icache();
+}
+
+void mmu_t::switch_context()
 {
   memset(tlb_insn_tag, -1, sizeof(tlb_insn_tag));
   memset(tlb_load_tag, -1, sizeof(tlb_load_tag));
   memset(tlb_store_tag, -1, sizeof(tlb_store_tag));
 
-  flush_icache();
+  fetch_ctx = translation_context(true);
 }
 
-void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
+reg_t mmu_t::translation_context(bool fetch)
 {
-  reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
-  reg_t expected_tag = addr >> PGSHIFT;
+  if (unlikely(!proc))
+    return 0;
 
-  reg_t pgbase;
-  if (unlikely(!proc)) {
-    pgbase = addr & -PGSIZE;
-  } else {
-    reg_t mode = get_field(proc->state.mstatus, MSTATUS_PRV);
-    if (!fetch && get_field(proc->state.mstatus, MSTATUS_MPRV))
-      mode = get_field(proc->state.mstatus, MSTATUS_PRV1);
-    if (get_field(proc->state.mstatus, MSTATUS_VM) == VM_MBARE)
-      mode = PRV_M;
-  
-    if (mode == PRV_M) {
-      reg_t msb_mask = (reg_t(2) << (proc->xlen-1))-1; // zero-extend from xlen
-      pgbase = addr & -PGSIZE & msb_mask;
-    } else {
-      pgbase = walk(addr, mode > PRV_U, store, fetch);
+  reg_t mode = get_field(proc->state.mstatus, MSTATUS_PRV);
+  if (!fetch && get_field(proc->state.mstatus, MSTATUS_MPRV))
+    mode = get_field(proc->state.mstatus, MSTATUS_PRV1);
+  reg_t vm = get_field(proc->state.mstatus, MSTATUS_VM);
+  if (vm == VM_MBARE || mode == PRV_M)
+    return 0;
+
+  // sptbr is page-aligned, which leaves room for the other fields
+  return proc->state.sptbr | (vm << 2) | ((mode > PRV_U) << 1) | 1;
+}
+
+reg_t mmu_t::translate_paddr(reg_t addr, bool store, bool fetch)
+{
+  if (unlikely(!proc))
+    return addr;
+
+  reg_t ctx = fetch ? fetch_ctx : translation_context(false);
+  if (ctx == 0) {
+    reg_t msb_mask = (reg_t(2) << (proc->xlen-1))-1; // zero-extend from xlen
+    return addr & msb_mask;
+  }
+
+  reg_t access = fetch ? TLB_FETCH : store ? TLB_STORE : TLB_LOAD;
+  for (size_t i = 0; i < SUPERPAGE_TLB_ENTRIES; i++)
+  {
+    superpage_entry_t* s = &tlb_superpage[i];
+    if (s->ctx == ctx && s->vbase == (addr & -s->size) && (s->access & access))
+    {
+      counters.tlb_superpage_hits++;
+      return s->pbase | (addr & (s->size-1));
     }
   }
 
-  reg_t pgoff = addr & (PGSIZE-1);
-  reg_t paddr = pgbase + pgoff;
+  reg_t vpn = addr >> PGSHIFT;
+  tlb_entry_t* e = NULL;
+  if (!tlb_l2.empty())
+  {
+    // spread the contexts over the TLB, so kernel and user mappings of
+    // the same page don't evict each other
+    size_t idx = (vpn ^ (ctx * 0x9e3779b97f4a7c15ULL >> 32)) & (tlb_l2.size() - 1);
+    e = &tlb_l2[idx];
+    if (e->ctx == ctx && e->vpn == vpn && (e->access & access))
+    {
+      counters.tlb_l2_hits++;
+      return e->pgbase | (addr & (PGSIZE-1));
+    }
+    counters.tlb_l2_misses++;
+  }
 
-  if (pgbase >= memsz) {
-    if (fetch) throw trap_instruction_access_fault(addr);
-    else if (store) throw trap_store_access_fault(addr);
-    else throw trap_load_access_fault(addr);
+  reg_t size;
+  reg_t base = walk(addr, (ctx >> 1) & 1, store, fetch, &size);
+  if (base == reg_t(-1))
+    return -1;
+
+  // walk() ORs the VA's low bits into the leaf's PPN, even if it isn't
+  // aligned, and so must the TLBs
+  if (size > PGSIZE)
+  {
+    superpage_entry_t* s = NULL;
+    for (size_t i = 0; i < SUPERPAGE_TLB_ENTRIES && !s; i++)
+      if (tlb_superpage[i].ctx == ctx && tlb_superpage[i].vbase == (addr & -size))
+        s = &tlb_superpage[i];
+    if (!s)
+    {
+      s = &tlb_superpage[tlb_superpage_victim];
+      tlb_superpage_victim = (tlb_superpage_victim + 1) % SUPERPAGE_TLB_ENTRIES;
+      *s = superpage_entry_t{ctx, addr & -size, size, base, 0};
+    }
+    s->access |= access;
+    return base | (addr & (size-1));
+  }
+
+  reg_t pgbase = base;
+  if (e)
+  {
+    if (e->ctx != ctx || e->vpn != vpn || e->pgbase != pgbase)
+      *e = tlb_entry_t{ctx, vpn, pgbase, 0};
+    e->access |= access;
+  }
+
+  return pgbase | (addr & (PGSIZE-1));
+}
+
+char* mmu_t::fill_tlb(reg_t addr, reg_t paddr, char* host, reg_t bytes, bool store, bool fetch)
+{
+  reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
+  reg_t expected_tag = addr >> PGSHIFT;
+  reg_t pgbase = paddr & -PGSIZE;
+  reg_t page = reg_t(host) >> PGSHIFT;
+
+  // stores to pages holding cached blocks make the new code visible
+  if (store && unlikely(code_pages.count(page)))
+  {
+    code_page_writes[page]++;
+    flush_icache();
   }
 
-  bool trace = tracer.interested_in_range(pgbase, pgbase + PGSIZE, store, fetch);
-  if (unlikely(!fetch && trace))
-    tracer.trace(paddr, bytes, store, fetch);
+  bool traced = tracer.interested_in_range(pgbase, pgbase + PGSIZE, store, fetch);
+  if (unlikely(!fetch && traced))
+    tracer.trace(paddr, bytes, store, fetch, proc ? proc->get_state()->pc : 0);
+  else if (unlikely(!fetch && trace))
+    ; // data accesses are recorded in the slow paths
   else
   {
     if (tlb_load_tag[idx] != expected_tag) tlb_load_tag[idx] = -1;
@@ -74,14 +380,90 @@ void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
     else if (store) tlb_store_tag[idx] = expected_tag;
     else tlb_load_tag[idx] = expected_tag;
 
-    tlb_data[idx] = mem + pgbase - (addr & -PGSIZE);
+    tlb_data[idx] = host - addr;
   }
 
-  return mem + paddr;
+  return host;
 }
 
-reg_t mmu_t::walk(reg_t addr, bool supervisor, bool store, bool fetch)
+void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
 {
+  (fetch ? counters.tlb_insn_misses : store ? counters.tlb_store_misses : counters.tlb_load_misses)++;
+
+  reg_t paddr = translate_paddr(addr, store, fetch);
+  char* host = paddr == reg_t(-1) ? NULL : sim->addr_to_mem(paddr);
+  if (!host) {
+    if (fetch) throw trap_instruction_access_fault(addr);
+    else if (store) throw trap_store_access_fault(addr);
+    else throw trap_load_access_fault(addr);
+  }
+
+  // AMOs don't pass their data through here
+  if (unlikely(trace != NULL) && !fetch)
+    trace->mem(addr, bytes, NULL, store);
+
+  return fill_tlb(addr, paddr, host, bytes, store, fetch);
+}
+
+char* mmu_t::peek(reg_t addr)
+{
+  if (unlikely(!proc))
+    return sim->addr_to_mem(addr);
+
+  reg_t ctx = translation_context(false);
+  if (ctx == 0)
+    return sim->addr_to_mem(addr & ((reg_t(2) << (proc->xlen-1))-1));
+
+  reg_t size;
+  reg_t base = walk(addr, (ctx >> 1) & 1, false, false, &size, true);
+  if (base == reg_t(-1))
+    return NULL;
+  return sim->addr_to_mem(base | (addr & (size-1)));
+}
+
+void mmu_t::load_slow_path(reg_t addr, reg_t len, uint8_t* bytes)
+{
+  counters.tlb_load_misses++;
+
+  reg_t paddr = translate_paddr(addr, false, false);
+  if (paddr == reg_t(-1))
+    throw trap_load_access_fault(addr);
+
+  if (char* host = sim->addr_to_mem(paddr))
+    memcpy(bytes, fill_tlb(addr, paddr, host, len, false, false), len);
+  else if (unlikely(mmio_blocked))
+    throw mmio_blocked_t();
+  else if (!sim->mmio_load(paddr, len, bytes))
+    throw trap_load_access_fault(addr);
+
+  if (unlikely(trace != NULL))
+    trace->mem(addr, len, bytes, false);
+}
+
+void mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes)
+{
+  counters.tlb_store_misses++;
+
+  reg_t paddr = translate_paddr(addr, true, false);
+  if (paddr == reg_t(-1))
+    throw trap_store_access_fault(addr);
+
+  if (char* host = sim->addr_to_mem(paddr))
+    memcpy(fill_tlb(addr, paddr, host, len, true, false), bytes, len);
+  else if (unlikely(mmio_blocked))
+    throw mmio_blocked_t();
+  else if (!sim->mmio_store(paddr, len, bytes))
+    throw trap_store_access_fault(addr);
+
+  if (unlikely(trace != NULL))
+    trace->mem(addr, len, bytes, true);
+}
+
+reg_t mmu_t::walk(reg_t addr, bool supervisor, bool store, bool fetch, reg_t* size, bool peek)
+{
+  if (!peek)
+    counters.walks++;
+
   int levels, ptidxbits, ptesize;
   switch (get_field(proc->get_state()->mstatus, MSTATUS_VM))
   {
@@ -100,34 +482,52 @@ reg_t mmu_t::walk(reg_t addr, bool supervisor, bool store, bool fetch)
 
   reg_t base = proc->get_state()->sptbr;
   int ptshift = (levels - 1) * ptidxbits;
-  for (int i = 0; i < levels; i++, ptshift -= ptidxbits) {
+  int i = 0;
+
+  // skip the levels whose PTEs are cached.  the tables are selected by
+  // ever more VA bits the deeper they are, so try the deepest first.
+  reg_t tag = base | get_field(proc->get_state()->mstatus, MSTATUS_VM);
+  for (int depth = levels - 1; depth > 0 && !peek; depth--) {
+    reg_t prefix = addr >> (PGSHIFT + (levels - depth) * ptidxbits);
+    walk_cache_entry_t* e = &walk_cache[depth-1][prefix % WALK_CACHE_ENTRIES];
+    if (e->tag == tag && e->prefix == prefix) {
+      counters.walk_cache_hits++;
+      counters.pte_reads_saved += depth;
+      base = e->base;
+      ptshift -= depth * ptidxbits;
+      i = depth;
+      break;
+    }
+  }
+  if (i == 0 && !peek)
+    counters.walk_cache_misses++;
+
+  for ( ; i < levels; i++, ptshift -= ptidxbits) {
     reg_t idx = (addr >> (PGSHIFT + ptshift)) & ((1 << ptidxbits) - 1);
 
     // check that physical address of PTE is legal
     reg_t pte_addr = base + idx * ptesize;
-    if (pte_addr >= memsz)
+    char* ppte = sim->addr_to_mem(pte_addr);
+    if (!ppte)
       break;
 
-    void* ppte = mem + pte_addr;
     reg_t pte = ptesize == 4 ? *(uint32_t*)ppte : *(uint64_t*)ppte;
     reg_t ppn = pte >> PTE_PPN_SHIFT;
 
     if (PTE_TABLE(pte)) { // next level of page table
       base = ppn << PGSHIFT;
+      if (i + 1 < levels && !peek) {
+        reg_t prefix = addr >> (PGSHIFT + ptshift);
+        walk_cache[i][prefix % WALK_CACHE_ENTRIES] = walk_cache_entry_t{tag, prefix, base};
+      }
     } else if (!PTE_CHECK_PERM(pte, supervisor, store, fetch)) {
       break;
     } else {
       // set referenced and possibly dirty bits.
-      *(uint32_t*)ppte |= PTE_R | (store * PTE_D);
-      // for superpage mappings, make a fake leaf PTE for the TLB's benefit.
-      reg_t vpn = addr >> PGSHIFT;
-      reg_t addr = (ppn | (vpn & ((reg_t(1) << ptshift) - 1))) << PGSHIFT;
-
-      // check that physical address is legal
-      if (addr >= memsz)
-        break;
-
-      return addr;
+      if (!peek)
+        __atomic_fetch_or((uint32_t*)ppte, PTE_R | (store * PTE_D), __ATOMIC_RELAXED);
+      *size = reg_t(1) << (PGSHIFT + ptshift);
+      return ppn << PGSHIFT;
     }
   }
 
@@ -138,4 +538,6 @@ void mmu_t::register_memtracer(memtracer_t* t)
 {
   flush_tlb();
   tracer.hook(t);
+  fetch_traced |= t->interested_in_range(0, -1, false, true);
+  pc_traced |= t->needs_pc();
 }
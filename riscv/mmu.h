@@ -10,11 +10,17 @@
 #include "processor.h"
 #include "memtracer.h"
 #include <vector>
+#include <set>
+#include <map>
 
 // virtual memory configuration
 #define PGSHIFT 12
 const reg_t PGSIZE = 1 << PGSHIFT;
 
+// thrown by an access that would reach a device while devices are
+// blocked
+struct mmio_blocked_t {};
+
 struct insn_fetch_t
 {
   insn_func_t func;
@@ -23,23 +29,70 @@ struct insn_fetch_t
 
 struct icache_entry_t {
   reg_t tag;
-  reg_t pad;
+  reg_t ctx; // the translation context the instruction was fetched in
   insn_fetch_t data;
 };
 
+// counts of events in the simulator's caches, kept per processor so that
+// cache sizes can be tuned and guest pathologies spotted
+struct mmu_counters_t
+{
+  uint64_t icache_hits;
+  uint64_t icache_misses;
+  uint64_t tlb_insn_hits;
+  uint64_t tlb_insn_misses;
+  uint64_t tlb_load_hits;
+  uint64_t tlb_load_misses;
+  uint64_t tlb_store_hits;
+  uint64_t tlb_store_misses;
+  uint64_t tlb_flushes;
+  uint64_t tlb_l2_hits;
+  uint64_t tlb_l2_misses;
+  uint64_t tlb_superpage_hits;
+  uint64_t walks;
+  uint64_t walk_cache_hits;
+  uint64_t walk_cache_misses;
+  uint64_t pte_reads_saved;
+};
+
+// a basic block of decoded instructions.  only the last instruction may
+// redirect control flow, so the others can be executed back to back.
+struct block_t {
+  static const size_t MAX_INSNS = 16;
+  reg_t tag;
+  reg_t ctx;
+  size_t length;
+  insn_fetch_t insns[MAX_INSNS];
+  bool read_only; // it doesn't write memory or CSRs (see processor_t::spinning)
+
+  // translated code, if the block is hot enough (see jit.h)
+  void* jit_code;
+  size_t jit_epoch;
+  size_t jit_hits;
+};
+
 // this class implements a processor's port into the virtual memory system.
 // an MMU and instruction cache are maintained for simulator performance.
 class mmu_t
 {
 public:
-  mmu_t(char* _mem, size_t _memsz);
+  mmu_t(sim_t* sim);
   ~mmu_t();
 
-  // template for functions that load an aligned value from memory
+  // template for functions that load an aligned value from memory.  the
+  // TLB only maps RAM, so device accesses always take the slow path.
   #define load_func(type) \
     type##_t load_##type(reg_t addr) __attribute__((always_inline)) { \
-      void* paddr = translate(addr, sizeof(type##_t), false, false); \
-      return *(type##_t*)paddr; \
+      if (unlikely(addr & (sizeof(type##_t)-1))) \
+        throw trap_load_address_misaligned(addr); \
+      reg_t vpn = addr >> PGSHIFT; \
+      if (likely(tlb_load_tag[vpn % TLB_ENTRIES] == vpn)) { \
+        counters.tlb_load_hits++; \
+        return *(type##_t*)(tlb_data[vpn % TLB_ENTRIES] + addr); \
+      } \
+      type##_t res; \
+      load_slow_path(addr, sizeof(type##_t), (uint8_t*)&res); \
+      return res; \
     }
 
   // load value from memory at aligned address; zero extend to register width
@@ -57,8 +110,15 @@ public:
   // template for functions that store an aligned value to memory
   #define store_func(type) \
     void store_##type(reg_t addr, type##_t val) { \
-      void* paddr = translate(addr, sizeof(type##_t), true, false); \
-      *(type##_t*)paddr = val; \
+      if (unlikely(addr & (sizeof(type##_t)-1))) \
+        throw trap_store_address_misaligned(addr); \
+      reg_t vpn = addr >> PGSHIFT; \
+      if (likely(tlb_store_tag[vpn % TLB_ENTRIES] == vpn)) { \
+        counters.tlb_store_hits++; \
+        *(type##_t*)(tlb_data[vpn % TLB_ENTRIES] + addr) = val; \
+      } else { \
+        store_slow_path(addr, sizeof(type##_t), (const uint8_t*)&val); \
+      } \
     }
 
   // store value to memory at aligned address
@@ -67,97 +127,249 @@ public:
   store_func(uint32)
   store_func(uint64)
 
-  static const reg_t ICACHE_ENTRIES = 1024;
+  // template for functions that perform an atomic memory operation.
+  // harts may run on different host threads, so the read-modify-write
+  // is done with a host compare-and-swap on the target location.  AMOs
+  // are only supported on RAM.
+  #define amo_func(type) \
+    template<typename op> \
+    type##_t amo_##type(reg_t addr, op f) { \
+      type##_t* paddr = (type##_t*)translate(addr, sizeof(type##_t), false, false); \
+      translate(addr, sizeof(type##_t), true, false); \
+      type##_t lhs = __atomic_load_n(paddr, __ATOMIC_RELAXED); \
+      while (!__atomic_compare_exchange_n(paddr, &lhs, f(lhs), true, \
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) \
+        ; \
+      return lhs; \
+    }
+
+  // template for functions that perform a store-conditional.  the store
+  // succeeds only if memory still holds the value observed by the
+  // load-reserved, which catches intervening stores from other harts.
+  #define store_conditional_func(type) \
+    bool store_conditional_##type(reg_t addr, type##_t expected, type##_t val) { \
+      type##_t* paddr = (type##_t*)translate(addr, sizeof(type##_t), true, false); \
+      return __atomic_compare_exchange_n(paddr, &expected, val, false, \
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED); \
+    }
+
+  // perform an atomic memory operation at an aligned address
+  amo_func(uint32)
+  amo_func(uint64)
+
+  // store value to memory at aligned address if the reservation holds
+  store_conditional_func(uint32)
+  store_conditional_func(uint64)
+
+  static const size_t DEFAULT_ICACHE_ENTRIES = 4096;
+
+  // resize the decoded-instruction caches.  entries must be a power of 2;
+  // ways may be 1 or 2.  the block cache gets a quarter as many entries.
+  void set_icache(size_t entries, size_t ways);
 
-  inline size_t icache_index(reg_t addr)
+  // 4-byte instructions map to consecutive sets; the halfword offset of
+  // 2-byte instructions is folded into the top index bit
+  static inline size_t cache_index(reg_t addr, size_t sets_log2)
   {
-    // for instruction sizes != 4, this hash still works but is suboptimal
-    return (addr / 4) % ICACHE_ENTRIES;
+    return ((addr >> 2) ^ (((addr >> 1) & 1) << (sets_log2 - 1)))
+           & ((size_t(1) << sets_log2) - 1);
   }
 
   // load instruction from memory at aligned address.
   icache_entry_t* access_icache(reg_t addr) __attribute__((always_inline))
   {
-    reg_t idx = icache_index(addr);
-    icache_entry_t* entry = &icache[idx];
-    if (likely(entry->tag == addr))
-      return entry;
-
-    char* iaddr = (char*)translate(addr, 1, false, true);
-    insn_bits_t insn = *(uint16_t*)iaddr;
-    int length = insn_length(insn);
-
-    if (likely(length == 4)) {
-      if (likely(addr % PGSIZE < PGSIZE-2))
-        insn |= (insn_bits_t)*(int16_t*)(iaddr + 2) << 16;
-      else
-        insn |= (insn_bits_t)*(int16_t*)translate(addr + 2, 1, false, true) << 16;
-    } else if (length == 2) {
-      insn = (int16_t)insn;
-    } else if (length == 6) {
-      insn |= (insn_bits_t)*(int16_t*)translate(addr + 4, 1, false, true) << 32;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 1, false, true) << 16;
-    } else {
-      static_assert(sizeof(insn_bits_t) == 8, "insn_bits_t must be uint64_t");
-      insn |= (insn_bits_t)*(int16_t*)translate(addr + 6, 1, false, true) << 48;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 4, 1, false, true) << 32;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 1, false, true) << 16;
-    }
-
-    insn_fetch_t fetch = {proc->decode_insn(insn), insn};
-    icache[idx].tag = addr;
-    icache[idx].data = fetch;
-
-    reg_t paddr = iaddr - mem;
-    if (!tracer.empty() && tracer.interested_in_range(paddr, paddr + 1, false, true))
+    icache_entry_t* set = &icache[cache_index(addr, icache_sets_log2) * icache_ways];
+    if (likely(set[0].tag == addr && set[0].ctx == fetch_ctx))
     {
-      icache[idx].tag = -1;
-      tracer.trace(paddr, length, false, true);
+      counters.icache_hits++;
+      return &set[0];
     }
-    return &icache[idx];
+    return refill_icache(addr, set);
   }
 
   inline insn_fetch_t load_insn(reg_t addr)
   {
-    return access_icache(addr)->data;
+    icache_entry_t* entry = access_icache(addr);
+    if (unlikely(fetch_traced))
+      trace_fetch(addr, entry->data.insn);
+    return entry->data;
   }
 
+  // look up the basic block starting at addr, decoding it on a miss
+  block_t* access_block(reg_t addr) __attribute__((always_inline))
+  {
+    block_t* block = &blocks[cache_index(addr, block_sets_log2)];
+    if (likely(block->tag == addr && block->ctx == fetch_ctx))
+      return block;
+    return refill_block(addr);
+  }
+
+  // blocks bypass the fetch path and don't keep state.pc up to date, so
+  // they can't be used if fetches or pcs are traced
+  bool blocks_enabled() { return !fetch_traced && !pc_traced; }
+
+  static const size_t DEFAULT_TLB_L2_ENTRIES = 4096;
+
+  // resize the second-level TLB.  entries must be a power of 2, or 0 to
+  // disable it.
+  void set_tlb(size_t l2_entries);
+
   void set_processor(processor_t* p) { proc = p; flush_tlb(); }
 
+  // flush every cached translation and decoded instruction
   void flush_tlb();
   void flush_icache();
 
+  // the privilege mode, VM mode or page table base has changed.  cached
+  // translations are tagged with the context they were made in, so only
+  // the first-level TLB needs to be flushed.
+  void switch_context();
+
   void register_memtracer(memtracer_t*);
 
+  // record data accesses in the binary trace.  this keeps them all on the
+  // slow path.
+  void set_trace(trace_buffer_t* t) { trace = t; flush_tlb(); }
+
+  // while devices are blocked, a load or store that doesn't target RAM
+  // throws mmio_blocked_t rather than reaching the device.  lockstep uses
+  // this to keep device side effects out of the pass it rolls back.
+  void set_mmio_blocked(bool value) { mmio_blocked = value; }
+
+  const mmu_counters_t& get_counters() { return counters; }
+
+  // the host address of the RAM a load from addr would read, or NULL if
+  // it wouldn't read RAM.  unlike a load, this has no side effects: it
+  // doesn't reach devices, fill the TLBs, trace or count the access, or
+  // set the PTE's referenced bit.  alignment isn't checked.
+  char* peek(reg_t addr);
+
 private:
-  char* mem;
-  size_t memsz;
+  sim_t* sim;
   processor_t* proc;
   memtracer_list_t tracer;
-
-  // implement an instruction cache for simulator performance
-  icache_entry_t icache[ICACHE_ENTRIES];
-
-  // implement a TLB for simulator performance
+  trace_buffer_t* trace;
+  mmu_counters_t counters;
+  bool mmio_blocked;
+
+  // implement an instruction cache for simulator performance.  the ways
+  // of each set are kept in most-recently-used order.
+  std::vector<icache_entry_t> icache;
+  size_t icache_sets_log2;
+  size_t icache_ways;
+
+  // decode the instruction at addr into the given set, or find it in a
+  // way other than the first
+  icache_entry_t* refill_icache(reg_t addr, icache_entry_t* set);
+  void trace_fetch(reg_t addr, insn_t insn);
+
+  // implement a basic block cache on top of the instruction cache
+  std::vector<block_t> blocks;
+  size_t block_sets_log2;
+  block_t scratch_block;
+  bool fetch_traced;
+  bool pc_traced;
+
+  // host pages that hold cached blocks, and the number of times stores
+  // to each page have forced its blocks out.  pages that keep getting
+  // written are run one instruction at a time rather than as blocks.
+  static const size_t MAX_CODE_PAGE_WRITES = 16;
+  std::set<reg_t> code_pages;
+  std::map<reg_t, size_t> code_page_writes;
+
+  // decode the basic block starting at addr
+  block_t* refill_block(reg_t addr);
+  void flush_blocks();
+
+  // implement a TLB for simulator performance.  the first level maps
+  // virtual pages in the current translation context straight to host
+  // memory, and is flushed whenever the context changes.
   static const reg_t TLB_ENTRIES = 256;
   char* tlb_data[TLB_ENTRIES];
   reg_t tlb_insn_tag[TLB_ENTRIES];
   reg_t tlb_load_tag[TLB_ENTRIES];
   reg_t tlb_store_tag[TLB_ENTRIES];
 
-  // finish translation on a TLB miss and upate the TLB
+  // the second level is a larger, direct-mapped cache of page walks,
+  // tagged with their translation context, so it survives traps and
+  // context switches.  each entry records the kinds of access the walk
+  // was done for, since walks check permissions and set the dirty bit.
+  enum { TLB_LOAD = 1, TLB_STORE = 2, TLB_FETCH = 4 };
+  struct tlb_entry_t
+  {
+    reg_t ctx;
+    reg_t vpn;
+    reg_t pgbase;
+    reg_t access;
+  };
+  std::vector<tlb_entry_t> tlb_l2;
+
+  // megapages and gigapages get entries of their own beside the second
+  // level, each covering the whole mapping, so a kernel's huge linear
+  // map needs a handful of entries rather than one per 4 KiB page.
+  // they're fully associative and replaced round-robin.
+  static const size_t SUPERPAGE_TLB_ENTRIES = 16;
+  struct superpage_entry_t
+  {
+    reg_t ctx;
+    reg_t vbase;
+    reg_t size;
+    reg_t pbase;
+    reg_t access;
+  };
+  superpage_entry_t tlb_superpage[SUPERPAGE_TLB_ENTRIES];
+  size_t tlb_superpage_victim;
+
+  // a translation context identifies everything but the page tables'
+  // contents that a translation depends on: the page table base, VM mode,
+  // and whether the access is by the supervisor.  0 means addresses
+  // aren't translated.
+  reg_t fetch_ctx;
+  reg_t translation_context(bool fetch);
+
+  // finish translation on a TLB miss and upate the TLB.  the target must
+  // be RAM.
   void* refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch);
 
-  // perform a page table walk for a given VA; set referenced/dirty bits
-  reg_t walk(reg_t addr, bool supervisor, bool store, bool fetch);
+  // map a page of RAM into the TLB, unless it is being traced
+  char* fill_tlb(reg_t addr, reg_t paddr, char* host, reg_t bytes, bool store, bool fetch);
+
+  // perform a load or store that missed in the TLB, which may target RAM
+  // or a device
+  void load_slow_path(reg_t addr, reg_t len, uint8_t* bytes);
+  void store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes);
+
+  // translate a virtual address to a physical one; returns -1 on failure
+  reg_t translate_paddr(reg_t addr, bool store, bool fetch);
+
+  // perform a page table walk for a given VA; set referenced/dirty bits.
+  // returns the base of the leaf mapping and its size, which is larger
+  // than a page for superpages.  a peek leaves the PTEs, the walk cache
+  // and the counters alone.
+  reg_t walk(reg_t addr, bool supervisor, bool store, bool fetch, reg_t* size, bool peek = false);
+
+  // a cache of the non-leaf PTEs read by page walks, so a walk can start
+  // from the deepest table already known to cover the VA.  there is one
+  // direct-mapped array per depth of table pointed to, keyed by the page
+  // table base and VM mode and by the VA bits that select the table.
+  static const size_t WALK_CACHE_LEVELS = 3;
+  static const size_t WALK_CACHE_ENTRIES = 32;
+  struct walk_cache_entry_t
+  {
+    reg_t tag;
+    reg_t prefix;
+    reg_t base;
+  };
+  walk_cache_entry_t walk_cache[WALK_CACHE_LEVELS][WALK_CACHE_ENTRIES];
 
-  // translate a virtual address to a physical address
+  // translate a virtual address to the host address of the RAM it maps to
   void* translate(reg_t addr, reg_t bytes, bool store, bool fetch)
     __attribute__((always_inline))
   {
     reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
     reg_t expected_tag = addr >> PGSHIFT;
     reg_t* tags = fetch ? tlb_insn_tag : store ? tlb_store_tag :tlb_load_tag;
+    uint64_t* hits = fetch ? &counters.tlb_insn_hits : store ? &counters.tlb_store_hits : &counters.tlb_load_hits;
     reg_t tag = tags[idx];
     void* data = tlb_data[idx] + addr;
 
@@ -167,7 +379,10 @@ private:
       throw trap_load_address_misaligned(addr);
 
     if (likely(tag == expected_tag))
+    {
+      (*hits)++;
       return data;
+    }
 
     return refill_tlb(addr, bytes, store, fetch);
   }
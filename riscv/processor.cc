@@ -5,8 +5,11 @@
 #include "common.h"
 #include "config.h"
 #include "sim.h"
-#include "htif.h"
 #include "disasm.h"
+#include "jit.h"
+#include "checkpoint.h"
+#include "profiler.h"
+#include "trace.h"
 #include <cinttypes>
 #include <cmath>
 #include <cstdlib>
@@ -20,12 +23,15 @@
 #define STATE state
 
 processor_t::processor_t(const char* isa, sim_t* sim, uint32_t id)
-  : sim(sim), ext(NULL), disassembler(new disassembler_t),
-    id(id), run(false), debug(false)
+  : sim(sim), ext(NULL), disassembler(new disassembler_t), jit(NULL),
+    profiler(NULL), profile_countdown(0), trace(NULL), id(id), run(false),
+    yield_requested(false), waiting(false), debug(false), sc_failures(0)
 {
+  set_histogram(false);
   parse_isa_string(isa);
+  memset(&counters, 0, sizeof(counters));
 
-  mmu = new mmu_t(sim->mem, sim->memsz);
+  mmu = new mmu_t(sim);
   mmu->set_processor(this);
 
   reset(true);
@@ -38,16 +44,7 @@ processor_t::processor_t(const char* isa, sim_t* sim, uint32_t id)
 
 processor_t::~processor_t()
 {
-#ifdef RISCV_ENABLE_HISTOGRAM
-  if (histogram_enabled)
-  {
-    fprintf(stderr, "PC Histogram size:%lu\n", pc_histogram.size());
-    for(auto iterator = pc_histogram.begin(); iterator != pc_histogram.end(); ++iterator) {
-      fprintf(stderr, "%0lx %lu\n", (iterator->first << 2), iterator->second);
-    }
-  }
-#endif
-
+  delete jit;
   delete mmu;
   delete disassembler;
 }
@@ -118,9 +115,42 @@ void processor_t::set_debug(bool value)
     ext->set_debug(value);
 }
 
-void processor_t::set_histogram(bool value)
+void processor_t::set_histogram(bool value, size_t period)
 {
   histogram_enabled = value;
+  histogram_period = std::max(period, size_t(1));
+  // a disabled histogram counts down from the largest size_t, so it never
+  // samples in practice and update_histogram needs no separate check
+  histogram_countdown = value ? histogram_period : -1;
+}
+
+void processor_t::set_jit(bool value, bool lockstep)
+{
+  if (!value || jit)
+    return;
+
+#if defined(RISCV_ENABLE_COMMITLOG) || defined(RISCV_ENABLE_HISTOGRAM)
+  // translated code doesn't maintain the commit log or the histogram
+  fprintf(stderr, "warning: the JIT is unavailable when the commit log or histogram is compiled in\n");
+#else
+  if (jit_t::supported())
+    jit = new jit_t(this, lockstep);
+  else
+    fprintf(stderr, "warning: the JIT is unavailable on this host\n");
+#endif
+}
+
+void processor_t::set_profiler(profiler_t* p)
+{
+  profiler = p;
+  if (p)
+    profile_countdown = p->get_period();
+}
+
+void processor_t::set_trace(trace_buffer_t* t)
+{
+  trace = t;
+  mmu->set_trace(t);
 }
 
 void processor_t::reset(bool value)
@@ -128,14 +158,34 @@ void processor_t::reset(bool value)
   if (run == !value)
     return;
   run = !value;
+  waiting = false;
 
   state.reset();
   set_csr(CSR_MSTATUS, state.mstatus);
+  mmu->flush_tlb();
 
   if (ext)
     ext->reset(); // reset the extension
 }
 
+void processor_t::checkpoint(checkpoint_t& ckpt)
+{
+  ckpt.check(cpuid, "ISA");
+  ckpt.check(ext ? std::hash<std::string>()(ext->name()) : 0, "extension");
+
+  ckpt.transfer(state);
+  ckpt.transfer(counters);
+  ckpt.transfer(run);
+  ckpt.transfer(xlen);
+
+  if (ext)
+    ext->checkpoint(ckpt);
+
+  // cached translations and decoded instructions refer to the old state
+  if (!ckpt.saving())
+    mmu->flush_tlb();
+}
+
 void processor_t::raise_interrupt(reg_t which)
 {
   throw trap_t(((reg_t)1 << (max_xlen-1)) | which);
@@ -187,8 +237,11 @@ static void commit_log(state_t* state, reg_t pc, insn_t insn)
 inline void processor_t::update_histogram(size_t pc)
 {
 #ifdef RISCV_ENABLE_HISTOGRAM
-  size_t idx = pc >> 2;
-  pc_histogram[idx]++;
+  if (unlikely(--histogram_countdown == 0))
+  {
+    histogram_countdown = histogram_period;
+    histogram.record(pc);
+  }
 #endif
 }
 
@@ -202,13 +255,72 @@ static reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
   return npc;
 }
 
+// the register an instruction writes, as (rd << 1) | is_fp, or 0 if it
+// writes none.  the trace works this out from the encoding, so register
+// writes needn't note themselves as they do for the commit log.
+static int trace_rd(insn_t insn)
+{
+  reg_t bits = insn.bits();
+  int rd = insn.rd();
+
+  if (insn_length(bits) == 2)
+  {
+    #define IS(name) ((bits & MASK_##name) == MATCH_##name)
+    if (IS(C_BEQZ) || IS(C_BNEZ) || IS(C_J) || IS(C_SD) || IS(C_SDSP) || IS(C_SW) || IS(C_SWSP))
+      return 0;
+    if (IS(C_LD) || IS(C_LW))
+      return insn.rvc_rds() << 1;
+    #undef IS
+    return rd << 1;
+  }
+
+  switch (bits & 0x7f)
+  {
+    case 0x03: // loads
+    case 0x13: // OP-IMM
+    case 0x17: // AUIPC
+    case 0x1b: // OP-IMM-32
+    case 0x2f: // AMOs
+    case 0x33: // OP
+    case 0x37: // LUI
+    case 0x3b: // OP-32
+    case 0x67: // JALR
+    case 0x6f: // JAL
+      return rd << 1;
+    case 0x73: // CSR accesses write rd; the rest of SYSTEM doesn't
+      return insn.rm() != 0 ? rd << 1 : 0;
+    case 0x0b: case 0x2b: case 0x5b: case 0x7b: // custom, if xd is set
+      return (bits >> 14) & 1 ? rd << 1 : 0;
+    case 0x07: // FP loads
+    case 0x43: case 0x47: case 0x4b: case 0x4f: // fused multiply-adds
+      return (rd << 1) | 1;
+    case 0x53: // compares, conversions to integer, moves to integer and
+               // classifies write an integer register
+      switch ((bits >> 27) & 0x1f)
+      {
+        case 0x14: case 0x18: case 0x1c: return rd << 1;
+        default: return (rd << 1) | 1;
+      }
+    default:
+      return 0;
+  }
+}
+
+// other harts may post IPIs from a different host thread, so updates to
+// mip must not lose bits that were set concurrently
+static void update_mip(state_t* state, reg_t mask, reg_t val)
+{
+  __atomic_fetch_and(&state->mip, ~mask | val, __ATOMIC_RELAXED);
+  __atomic_fetch_or(&state->mip, mask & val, __ATOMIC_RELAXED);
+}
+
 static void update_timer(state_t* state, size_t instret)
 {
   uint64_t count0 = (uint64_t)(uint32_t)state->mtime;
   state->mtime += instret;
   uint64_t before = count0 - state->stimecmp;
   if (int64_t(before ^ (before + instret)) < 0)
-    state->mip |= MIP_STIP;
+    update_mip(state, MIP_STIP, MIP_STIP);
 }
 
 static size_t next_timer(state_t* state)
@@ -222,53 +334,122 @@ void processor_t::step(size_t n)
   reg_t pc = state.pc;
   mmu_t* _mmu = mmu;
 
+  yield_requested = false;
+  spin_pc = -1;
   if (unlikely(!run || !n))
     return;
   n = std::min(n, next_timer(&state) | 1U);
 
+  // a parked hart's time passes at once, up to the timer interrupt if that
+  // comes first, and it gives up its turn
+  if (unlikely(waiting))
+  {
+    if (!(state.mip & state.mie) && !state.fromhost)
+    {
+      update_timer(&state, n);
+      yield_requested = true;
+      return;
+    }
+    waiting = false;
+  }
+
+  // stop at the next profile sample, so the loops below needn't check
+  if (unlikely(profiler != NULL))
+    n = std::min(n, profile_countdown);
+
   #define maybe_serialize() \
    if (unlikely(pc == PC_SERIALIZE)) { \
      pc = state.pc; \
+     counters.serializations++; \
      state.serialized = true; \
      continue; \
    }
 
   try
   {
+    // an interrupt is recorded as a trap at the next instruction
+    if (unlikely(trace != NULL))
+      trace->begin(pc, get_field(state.mstatus, MSTATUS_PRV));
     take_interrupt();
 
-    if (unlikely(debug))
+    if (unlikely(trace != NULL))
     {
-      while (instret < n)
+      // one instruction at a time, so each can be recorded as it retires
+      while (instret < n && likely(!yield_requested))
       {
+        trace_record_t* r = trace->begin(pc, get_field(state.mstatus, MSTATUS_PRV));
         insn_fetch_t fetch = mmu->load_insn(pc);
-        if (!state.serialized)
+        r->insn = fetch.insn.bits() & ((1ULL << (8 * insn_length(fetch.insn.bits()))) - 1);
+        if (unlikely(debug) && !state.serialized)
           disasm(fetch.insn);
         pc = execute_insn(this, pc, fetch);
         maybe_serialize();
+        if (int rd = trace_rd(fetch.insn))
+        {
+          r->flags |= trace_record_t::RD_WRITE | (rd & 1 ? trace_record_t::RD_FP : 0);
+          r->rd = rd >> 1;
+          r->rd_data = rd & 1 ? state.FPR[rd >> 1] : state.XPR[rd >> 1];
+        }
+        trace->commit();
         instret++;
         state.pc = pc;
       }
     }
-    else while (instret < n)
+    else if (unlikely(debug))
     {
-      size_t idx = _mmu->icache_index(pc);
-      auto ic_entry = _mmu->access_icache(pc);
-
-      #define ICACHE_ACCESS(idx) { \
-        insn_fetch_t fetch = ic_entry->data; \
-        ic_entry++; \
-        pc = execute_insn(this, pc, fetch); \
-        if (idx == mmu_t::ICACHE_ENTRIES-1) break; \
-        if (unlikely(ic_entry->tag != pc)) break; \
-        instret++; \
-        state.pc = pc; \
+      while (instret < n && likely(!yield_requested))
+      {
+        insn_fetch_t fetch = mmu->load_insn(pc);
+        if (!state.serialized)
+          disasm(fetch.insn);
+        pc = execute_insn(this, pc, fetch);
+        maybe_serialize();
+        instret++;
+        state.pc = pc;
       }
-
-      switch (idx) {
-        #include "icache.h"
+    }
+    else if (likely(_mmu->blocks_enabled()))
+    {
+      while (instret < n && likely(!yield_requested))
+      {
+        block_t* block = _mmu->access_block(pc);
+        if (unlikely(jit != NULL) && block->length <= n - instret
+            && jit->execute(block, pc, instret))
+        {
+          maybe_serialize();
+          state.pc = pc;
+        }
+        else
+        {
+          insn_fetch_t* insn = block->insns;
+          insn_fetch_t* last = insn + std::min(block->length, n - instret) - 1;
+
+          // all but the last instruction of a block fall through
+          for ( ; insn != last; insn++)
+          {
+            pc = execute_insn(this, pc, *insn);
+            instret++;
+          }
+
+          state.pc = pc; // the last instruction may ask to be replayed
+          pc = execute_insn(this, pc, *last);
+          maybe_serialize();
+          instret++;
+          state.pc = pc;
+        }
+
+        // a block that loops back to itself may be waiting on another hart
+        if (unlikely(pc == block->tag) && block->read_only && spinning(pc))
+        {
+          counters.spin_yields++;
+          yield_requested = true;
+        }
       }
-
+    }
+    else while (instret < n && likely(!yield_requested))
+    {
+      insn_fetch_t fetch = _mmu->load_insn(pc);
+      pc = execute_insn(this, pc, fetch);
       maybe_serialize();
       instret++;
       state.pc = pc;
@@ -276,10 +457,55 @@ void processor_t::step(size_t n)
   }
   catch(trap_t& t)
   {
+    if (unlikely(trace != NULL))
+    {
+      trace_record_t* r = trace->current();
+      r->flags |= trace_record_t::TRAP;
+      r->rd_data = t.cause();
+      trace->commit();
+    }
+    counters.traps++;
     state.pc = take_trap(t, pc);
   }
 
+  counters.instret += instret;
   update_timer(&state, instret);
+
+  if (unlikely(profiler != NULL) && (profile_countdown -= instret) == 0)
+  {
+    profiler->sample(this);
+    profile_countdown = profiler->get_period();
+  }
+}
+
+void processor_t::store_conditional_done(bool succeeded)
+{
+  if (succeeded)
+    sc_failures = 0;
+  else if (++sc_failures == SC_FAILURE_STREAK)
+  {
+    sc_failures = 0;
+    counters.spin_yields++;
+    yield();
+  }
+}
+
+// whether the read-only loop at pc is spinning: if its registers are the
+// same as SPIN_INTERVAL iterations ago, it will go round forever unless
+// another hart (or the host) changes the memory it reads
+bool processor_t::spinning(reg_t pc)
+{
+  if (pc == spin_pc && --spin_countdown != 0)
+    return false;
+
+  bool same = pc == spin_pc &&
+              memcmp(&spin_xpr, &state.XPR, sizeof(spin_xpr)) == 0 &&
+              memcmp(&spin_fpr, &state.FPR, sizeof(spin_fpr)) == 0;
+  spin_pc = pc;
+  spin_countdown = SPIN_INTERVAL;
+  spin_xpr = state.XPR;
+  spin_fpr = state.FPR;
+  return same;
 }
 
 void processor_t::push_privilege_stack()
@@ -324,7 +550,7 @@ reg_t processor_t::take_trap(trap_t& t, reg_t epc)
 
 void processor_t::deliver_ipi()
 {
-  state.mip |= MIP_MSIP;
+  update_mip(&state, MIP_MSIP, MIP_MSIP);
 }
 
 void processor_t::disasm(insn_t insn)
@@ -392,8 +618,9 @@ void processor_t::set_csr(int which, reg_t val)
       state.sutime_delta = (val << 32) | (uint32_t)state.sutime_delta;
       break;
     case CSR_MSTATUS: {
-      if ((val ^ state.mstatus) & (MSTATUS_VM | MSTATUS_PRV | MSTATUS_PRV1 | MSTATUS_MPRV))
-        mmu->flush_tlb();
+      // translations are tagged with the privilege mode and page table, so
+      // changing them needn't flush the TLB
+      bool ctx_changed = (val ^ state.mstatus) & (MSTATUS_VM | MSTATUS_PRV | MSTATUS_PRV1 | MSTATUS_MPRV);
 
       reg_t mask = MSTATUS_IE | MSTATUS_IE1 | MSTATUS_IE2 | MSTATUS_MPRV
                    | MSTATUS_FS | (ext ? MSTATUS_XS : 0);
@@ -419,11 +646,14 @@ void processor_t::set_csr(int which, reg_t val)
       // spike supports the notion of xlen < max_xlen, but current priv spec
       // doesn't provide a mechanism to run RV32 software on an RV64 machine
       xlen = max_xlen;
+
+      if (ctx_changed)
+        mmu->switch_context();
       break;
     }
     case CSR_MIP: {
       reg_t mask = MIP_SSIP | MIP_MSIP;
-      state.mip = (state.mip & ~mask) | (val & mask);
+      update_mip(&state, mask, val & mask);
       break;
     }
     case CSR_MIE: {
@@ -443,7 +673,7 @@ void processor_t::set_csr(int which, reg_t val)
     }
     case CSR_SIP: {
       reg_t mask = MIP_SSIP;
-      state.mip = (state.mip & ~mask) | (val & mask);
+      update_mip(&state, mask, val & mask);
       break;
     }
     case CSR_SIE: {
@@ -454,10 +684,13 @@ void processor_t::set_csr(int which, reg_t val)
     case CSR_SEPC: state.sepc = val; break;
     case CSR_STVEC: state.stvec = val & ~3; break;
     case CSR_STIMECMP:
-      state.mip &= ~MIP_STIP;
+      update_mip(&state, MIP_STIP, 0);
       state.stimecmp = val;
       break;
-    case CSR_SPTBR: state.sptbr = zext_xlen(val & -PGSIZE); break;
+    case CSR_SPTBR:
+      state.sptbr = zext_xlen(val & -PGSIZE);
+      mmu->switch_context();
+      break;
     case CSR_SSCRATCH: state.sscratch = val; break;
     case CSR_MEPC: state.mepc = val; break;
     case CSR_MSCRATCH: state.mscratch = val; break;
@@ -467,6 +700,8 @@ void processor_t::set_csr(int which, reg_t val)
     case CSR_MTOHOST:
       if (state.tohost == 0)
         state.tohost = val;
+      if (val != 0)
+        sim->request_htif(this);
       break;
     case CSR_MFROMHOST: state.fromhost = val; break;
   }
@@ -552,11 +787,14 @@ reg_t processor_t::get_csr(int which)
     case CSR_MHARTID: return id;
     case CSR_MTVEC: return DEFAULT_MTVEC;
     case CSR_MTDELEG: return 0;
+    // a hart polling these is waiting on the host
     case CSR_MTOHOST:
-      sim->get_htif()->tick(); // not necessary, but faster
+      if (state.tohost != 0)
+        sim->request_htif(this);
       return state.tohost;
     case CSR_MFROMHOST:
-      sim->get_htif()->tick(); // not necessary, but faster
+      if (state.fromhost == 0)
+        sim->request_htif(this);
       return state.fromhost;
     case CSR_SEND_IPI: return 0;
     case CSR_UARCH0:
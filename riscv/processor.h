@@ -4,6 +4,7 @@
 
 #include "decode.h"
 #include "config.h"
+#include "histogram.h"
 #include <cstring>
 #include <vector>
 #include <map>
@@ -15,6 +16,10 @@ class sim_t;
 class trap_t;
 class extension_t;
 class disassembler_t;
+class jit_t;
+class checkpoint_t;
+class profiler_t;
+class trace_buffer_t;
 
 struct insn_desc_t
 {
@@ -30,6 +35,15 @@ struct commit_log_reg_t
   reg_t data;
 };
 
+// counts of simulator events for one hart
+struct processor_counters_t
+{
+  uint64_t instret;
+  uint64_t traps;
+  uint64_t serializations;
+  uint64_t spin_yields; // turns given up in spin loops or to SC failures
+};
+
 // architectural state of a RISC-V hart
 struct state_t
 {
@@ -63,10 +77,9 @@ struct state_t
   uint32_t frm;
 
   reg_t load_reservation;
+  reg_t load_reservation_value;
 
-#ifdef RISCV_ENABLE_COMMITLOG
-  commit_log_reg_t log_reg_write;
-#endif
+  commit_log_reg_t log_reg_write; // the last register written, for the commit log
 };
 
 // this class represents one processor in a RISC-V machine.
@@ -77,9 +90,16 @@ public:
   ~processor_t();
 
   void set_debug(bool value);
-  void set_histogram(bool value);
+  void set_histogram(bool value, size_t period = 1);
+  void set_jit(bool value, bool lockstep);
+  void set_profiler(profiler_t* p);
+  void set_trace(trace_buffer_t* t);
   void reset(bool value);
+  void checkpoint(checkpoint_t& ckpt); // save or restore the hart's state
   void step(size_t n); // run for n cycles
+  void yield() { yield_requested = true; } // end the step after this instruction
+  bool yielded() { return yield_requested; } // whether the last step ended early
+  void wait_for_interrupt() { waiting = true; yield(); } // park the hart
   void deliver_ipi(); // register an interprocessor interrupt
   bool running() { return run; }
   void set_csr(int which, reg_t val);
@@ -87,6 +107,7 @@ public:
   reg_t get_csr(int which);
   mmu_t* get_mmu() { return mmu; }
   state_t* get_state() { return &state; }
+  const processor_counters_t& get_counters() { return counters; }
   extension_t* get_extension() { return ext; }
   bool supports_extension(unsigned char ext) {
     return ext >= 'A' && ext <= 'Z' && ((cpuid >> (ext - 'A')) & 1);
@@ -94,6 +115,7 @@ public:
   void push_privilege_stack();
   void pop_privilege_stack();
   void yield_load_reservation() { state.load_reservation = (reg_t)-1; }
+  void store_conditional_done(bool succeeded); // note the outcome of an SC
   void update_histogram(size_t pc);
 
   void register_insn(insn_desc_t);
@@ -104,19 +126,42 @@ private:
   mmu_t* mmu; // main memory is always accessed via the mmu
   extension_t* ext;
   disassembler_t* disassembler;
+  jit_t* jit; // translates hot blocks to host code, if enabled
+  profiler_t* profiler; // samples call stacks, if enabled
+  size_t profile_countdown; // instructions until the next sample
+  trace_buffer_t* trace; // records retired instructions, if enabled
   state_t state;
+  processor_counters_t counters;
   reg_t cpuid;
   uint32_t id;
   int max_xlen;
   int xlen;
   bool run; // !reset
+  bool yield_requested;
+  bool waiting; // parked by wfi until an interrupt is pending
   bool debug;
   bool histogram_enabled;
+  size_t histogram_period; // sample every this many instructions
+  size_t histogram_countdown;
+
+  // the loop being checked for spinning, and its registers when last checked
+  static const size_t SPIN_INTERVAL = 32; // iterations between checks
+  reg_t spin_pc;
+  size_t spin_countdown;
+  regfile_t<reg_t, NXPR, true> spin_xpr;
+  regfile_t<freg_t, NFPR, false> spin_fpr;
+  bool spinning(reg_t pc);
+
+  // SCs fail when another hart, on another host thread, writes the
+  // reserved location.  a hart whose SCs keep failing is contending for a
+  // lock it can't take this turn.
+  static const size_t SC_FAILURE_STREAK = 8; // failures in a row before yielding
+  size_t sc_failures;
 
   std::vector<insn_desc_t> instructions;
   std::vector<insn_desc_t*> opcode_map;
   std::vector<insn_desc_t> opcode_store;
-  std::map<size_t,size_t> pc_histogram;
+  histogram_t histogram;
 
   void take_interrupt(); // take a trap if any interrupts are pending
   reg_t take_trap(trap_t& t, reg_t epc); // take an exception
@@ -125,6 +170,8 @@ private:
   friend class sim_t;
   friend class mmu_t;
   friend class extension_t;
+  friend class jit_t;
+  friend class profiler_t;
 
   void parse_isa_string(const char* isa);
   void build_opcode_map();
@@ -0,0 +1,167 @@
+// See LICENSE for license details.
+
+#include "profiler.h"
+#include "processor.h"
+#include "mmu.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+profiler_t::profiler_t(size_t nprocs, size_t period)
+  : period(std::max(period, size_t(1))), stacks(nprocs)
+{
+}
+
+bool profiler_t::add_symbols(const char* file)
+{
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < EI_NIDENT)
+  {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  const char* elf = (const char*)p;
+  bool ok = memcmp(elf, ELFMAG, SELFMAG) == 0;
+  if (ok && elf[EI_CLASS] == ELFCLASS64)
+    add_elf_symbols<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym>(elf, st.st_size);
+  else if (ok && elf[EI_CLASS] == ELFCLASS32)
+    add_elf_symbols<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym>(elf, st.st_size);
+  else
+    ok = false;
+
+  munmap(p, st.st_size);
+  std::sort(symbols.begin(), symbols.end());
+  return ok;
+}
+
+template<class ehdr_t, class shdr_t, class sym_t>
+void profiler_t::add_elf_symbols(const char* elf, size_t size)
+{
+  const ehdr_t* eh = (const ehdr_t*)elf;
+  if (eh->e_shoff + eh->e_shnum * sizeof(shdr_t) > size)
+    return;
+
+  const shdr_t* sh = (const shdr_t*)(elf + eh->e_shoff);
+  for (size_t i = 0; i < eh->e_shnum; i++)
+  {
+    if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+      continue;
+
+    const shdr_t& strtab = sh[sh[i].sh_link];
+    if (sh[i].sh_offset + sh[i].sh_size > size || strtab.sh_offset + strtab.sh_size > size)
+      continue;
+
+    const sym_t* syms = (const sym_t*)(elf + sh[i].sh_offset);
+    const char* strs = elf + strtab.sh_offset;
+    for (size_t j = 0; j < sh[i].sh_size / sizeof(sym_t); j++)
+    {
+      // the type is in the low nibble of st_info for both classes
+      if ((syms[j].st_info & 0xf) != STT_FUNC || syms[j].st_name >= strtab.sh_size)
+        continue;
+      symbol_t s = {syms[j].st_value, syms[j].st_size,
+                    std::string(strs + syms[j].st_name,
+                                strnlen(strs + syms[j].st_name, strtab.sh_size - syms[j].st_name))};
+      symbols.push_back(s);
+    }
+  }
+}
+
+void profiler_t::sample(processor_t* p)
+{
+  std::vector<reg_t> stack;
+  state_t* state = p->get_state();
+  stack.push_back(state->pc);
+
+  // each frame saves ra at fp - xlen/8 and the caller's fp at fp - xlen/4.
+  // frames get older as fp increases, which guarantees the walk ends.
+  // the frames are peeked at rather than loaded, so that a bad fp can't
+  // reach a device and the reads aren't traced as the guest's own.
+  mmu_t* mmu = p->get_mmu();
+  reg_t wordsize = p->xlen / 8;
+  reg_t fp = state->XPR[8];
+  while (stack.size() < MAX_DEPTH && fp >= 2 * wordsize && fp % wordsize == 0)
+  {
+    char* ra_host = mmu->peek(fp - wordsize);
+    char* next_host = mmu->peek(fp - 2 * wordsize);
+    if (!ra_host || !next_host)
+      break;
+
+    reg_t ra, next;
+    if (wordsize == 8)
+      ra = *(uint64_t*)ra_host, next = *(uint64_t*)next_host;
+    else
+      ra = *(uint32_t*)ra_host, next = *(uint32_t*)next_host;
+    if (ra == 0)
+      break;
+    stack.push_back(ra);
+    if (next <= fp)
+      break;
+    fp = next;
+  }
+
+  std::reverse(stack.begin(), stack.end());
+  stacks[p->id][stack]++;
+}
+
+std::string profiler_t::symbolize(reg_t pc)
+{
+  auto it = std::upper_bound(symbols.begin(), symbols.end(), symbol_t{pc, 0, ""});
+  if (it != symbols.begin())
+  {
+    --it;
+    // symbols without a size (often hand-written assembly) extend up to
+    // the next symbol
+    if (pc - it->addr < it->size || it->size == 0)
+      return it->name;
+  }
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%" PRIx64, pc);
+  return buf;
+}
+
+void profiler_t::write(const char* file)
+{
+  // resolve every stack, merging the harts and stacks that resolve alike
+  std::map<std::string, uint64_t> folded;
+  for (size_t i = 0; i < stacks.size(); i++)
+  {
+    for (auto it = stacks[i].begin(); it != stacks[i].end(); ++it)
+    {
+      std::string s;
+      for (size_t j = 0; j < it->first.size(); j++)
+      {
+        // return addresses point after the call, which may be in the next
+        // function; the innermost frame is the sampled PC itself
+        bool ret = j + 1 < it->first.size();
+        s += (j ? ";" : "") + symbolize(it->first[j] - ret);
+      }
+      folded[s] += it->second;
+    }
+  }
+
+  FILE* f = fopen(file, "w");
+  if (f == NULL)
+  {
+    fprintf(stderr, "error: could not write profile %s: %s\n", file, strerror(errno));
+    return;
+  }
+  for (auto it = folded.begin(); it != folded.end(); ++it)
+    fprintf(f, "%s %" PRIu64 "\n", it->first.c_str(), it->second);
+  fclose(f);
+}
@@ -0,0 +1,55 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_PROFILER_H
+#define _RISCV_PROFILER_H
+
+#include "decode.h"
+#include <map>
+#include <string>
+#include <vector>
+
+class processor_t;
+
+// samples the harts' call stacks every so many retired instructions, and
+// writes them out as folded stacks: one line per distinct stack, with its
+// frames outermost first, separated by semicolons, then the number of
+// samples.  this is the input format of flamegraph.pl and similar tools.
+//
+// stacks are found by following the chain of frame pointers (s0), so guest
+// code should be compiled with -fno-omit-frame-pointer.  the caller of a
+// leaf function that doesn't save ra is lost.
+class profiler_t
+{
+ public:
+  profiler_t(size_t nprocs, size_t period);
+
+  // resolve PCs against the function symbols of an ELF file.  returns
+  // false if the file isn't an ELF file.
+  bool add_symbols(const char* file);
+
+  size_t get_period() { return period; }
+  void sample(processor_t* p);
+  void write(const char* file);
+
+ private:
+  static const size_t MAX_DEPTH = 128;
+
+  struct symbol_t
+  {
+    reg_t addr;
+    reg_t size;
+    std::string name;
+    bool operator<(const symbol_t& rhs) const { return addr < rhs.addr; }
+  };
+
+  size_t period;
+  std::vector<symbol_t> symbols; // sorted by address
+  // per hart, so harts on different host threads don't contend
+  std::vector<std::map<std::vector<reg_t>, uint64_t>> stacks;
+
+  template<class ehdr_t, class shdr_t, class sym_t>
+  void add_elf_symbols(const char* elf, size_t size);
+  std::string symbolize(reg_t pc);
+};
+
+#endif
@@ -2,12 +2,18 @@
 
 #include "sim.h"
 #include "htif.h"
+#include "checkpoint.h"
 #include <map>
 #include <iostream>
 #include <climits>
+#include <cinttypes>
 #include <cstdlib>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 volatile bool ctrlc_pressed = false;
 static void handle_signal(int sig)
@@ -18,28 +24,36 @@ static void handle_signal(int sig)
   signal(sig, &handle_signal);
 }
 
-sim_t::sim_t(const char* isa, size_t nprocs, size_t mem_mb,
-             const std::vector<std::string>& args)
-  : htif(new htif_isasim_t(this, args)), procs(std::max(nprocs, size_t(1))),
-    current_step(0), current_proc(0), debug(false)
+sim_t::sim_t(const char* isa, size_t nprocs,
+             const std::vector<std::pair<reg_t, size_t>>& mem_layout,
+             const std::vector<std::string>& args,
+             const char* mem_file, bool hugepages)
+  : htif(new htif_isasim_t(this, args)), htif_args(args),
+    procs(std::max(nprocs, size_t(1))),
+    now(0), htif_requested(false),
+    current_step(0), current_proc(0), debug(false), histogram_enabled(false),
+    stats(false),
+    save_checkpoint_file(NULL), save_checkpoint_instret(0),
+    load_checkpoint_file(NULL), fork_marker(0), fork_pending(false),
+    fork_hart(0), nthreads(1),
+    quantum(INTERLEAVE), round(0), groups_pending(0),
+    workers_exit(false)
 {
   signal(SIGINT, &handle_signal);
-  // allocate target machine's memory, shrinking it as necessary
-  // until the allocation succeeds
-  size_t memsz0 = (size_t)mem_mb << 20;
-  size_t quantum = 1L << 20;
-  if (memsz0 == 0)
-    memsz0 = 1L << (sizeof(size_t) == 8 ? 32 : 30);
 
-  memsz = memsz0;
-  while ((mem = (char*)calloc(1, memsz)) == NULL)
-    memsz = memsz*10/11/quantum*quantum;
+  std::vector<std::pair<reg_t, size_t>> layout = mem_layout;
+  if (layout.empty())
+    layout.push_back(std::make_pair(reg_t(0), size_t(1) << (sizeof(size_t) == 8 ? 32 : 30)));
 
-  if (memsz != memsz0)
-    fprintf(stderr, "warning: only got %lu bytes of target mem (wanted %lu)\n",
-            (unsigned long)memsz, (unsigned long)memsz0);
+  for (size_t i = 0; i < layout.size(); i++)
+  {
+    mem_t* m = new mem_t(layout[i].second, hugepages, i == 0 ? mem_file : NULL);
+    mems.push_back(std::make_pair(layout[i].first, m));
+    bus.add_device(layout[i].first, m, layout[i].second);
+  }
 
-  debug_mmu = new mmu_t(mem, memsz);
+  debug_mmu = new mmu_t(this);
+  schedule(HTIF_INTERVAL, [this]{ poll_htif(); });
 
   for (size_t i = 0; i < procs.size(); i++)
     procs[i] = new processor_t(isa, this, i);
@@ -47,10 +61,63 @@ sim_t::sim_t(const char* isa, size_t nprocs, size_t mem_mb,
 
 sim_t::~sim_t()
 {
+  stop_workers();
+
+  if (stats)
+    for (size_t i = 0; i < procs.size(); i++)
+      print_counters(i);
+
+#ifdef RISCV_ENABLE_HISTOGRAM
+  if (histogram_enabled)
+    write_histogram();
+#endif
+
+  if (profiler)
+    profiler->write(profile_file.c_str());
+
+  trace.reset();
+
   for (size_t i = 0; i < procs.size(); i++)
     delete procs[i];
   delete debug_mmu;
-  free(mem);
+  for (size_t i = 0; i < mems.size(); i++)
+    delete mems[i].second;
+}
+
+static void print_ratio(const char* name, uint64_t hits, uint64_t misses)
+{
+  fprintf(stderr, "  %-12s %14" PRIu64 " hits %12" PRIu64 " misses (%.2f%% miss rate)\n",
+          name, hits, misses, 100.0 * misses / std::max(hits + misses, uint64_t(1)));
+}
+
+void sim_t::print_counters(size_t core)
+{
+  const processor_counters_t& pc = procs[core]->get_counters();
+  const mmu_counters_t& mc = procs[core]->get_mmu()->get_counters();
+
+  fprintf(stderr, "core %zu:\n", core);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "instret", pc.instret);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "traps", pc.traps);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "serializes", pc.serializations);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "spin yields", pc.spin_yields);
+  print_ratio("icache", mc.icache_hits, mc.icache_misses);
+  print_ratio("itlb", mc.tlb_insn_hits, mc.tlb_insn_misses);
+  print_ratio("dtlb load", mc.tlb_load_hits, mc.tlb_load_misses);
+  print_ratio("dtlb store", mc.tlb_store_hits, mc.tlb_store_misses);
+  print_ratio("l2 tlb", mc.tlb_l2_hits, mc.tlb_l2_misses);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "hugepage tlb", mc.tlb_superpage_hits);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "tlb flushes", mc.tlb_flushes);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "page walks", mc.walks);
+  print_ratio("walk cache", mc.walk_cache_hits, mc.walk_cache_misses);
+  fprintf(stderr, "  %-12s %14" PRIu64 "\n", "PTEs skipped", mc.pte_reads_saved);
+}
+
+reg_t sim_t::mem_to_addr(char* x)
+{
+  for (size_t i = 0; i < mems.size(); i++)
+    if (size_t(x - mems[i].second->contents()) < mems[i].second->size())
+      return mems[i].first + (x - mems[i].second->contents());
+  return -1;
 }
 
 void sim_t::send_ipi(reg_t who)
@@ -64,43 +131,295 @@ reg_t sim_t::get_scr(int which)
   switch (which)
   {
     case 0: return procs.size();
-    case 1: return memsz >> 20;
+    case 1: // MiB of RAM at address 0
+      for (size_t i = 0; i < mems.size(); i++)
+        if (mems[i].first == 0)
+          return mems[i].second->size() >> 20;
+      return 0;
     default: return -1;
   }
 }
 
 int sim_t::run()
 {
-  while (htif->tick())
+  // a checkpoint replaces the program anyway
+  if (!load_checkpoint_file)
+    load_program();
+
+  // the front-end loads the program and releases the harts; after that,
+  // it's serviced by events as the harts run
+  htif->tick();
+  while (!htif->done())
   {
+    int exit_code;
+    if (fork_pending && serve_forks(&exit_code))
+      return exit_code;
+
+    // the program has been loaded and the harts released from reset, so
+    // the checkpoint's state can take their place
+    if (load_checkpoint_file)
+    {
+      checkpoint_t ckpt(load_checkpoint_file, false);
+      checkpoint(ckpt);
+      load_checkpoint_file = NULL;
+    }
+
+    if (save_checkpoint_file && total_instret() >= save_checkpoint_instret)
+    {
+      checkpoint_t ckpt(save_checkpoint_file, true);
+      checkpoint(ckpt);
+      save_checkpoint_file = NULL;
+    }
+
     if (debug || ctrlc_pressed)
       interactive();
+    else if (nthreads > 1)
+      step_parallel();
+    else if (save_checkpoint_file)
+      step(std::min(INTERLEAVE, size_t(save_checkpoint_instret - total_instret())));
     else
       step(INTERLEAVE);
   }
   return htif->exit_code();
 }
 
+reg_t sim_t::total_instret()
+{
+  reg_t instret = 0;
+  for (size_t i = 0; i < procs.size(); i++)
+    instret += procs[i]->get_counters().instret;
+  return instret;
+}
+
+void sim_t::set_save_checkpoint(const char* file, reg_t instret)
+{
+  save_checkpoint_file = file;
+  save_checkpoint_instret = instret;
+}
+
+void sim_t::set_load_checkpoint(const char* file)
+{
+  load_checkpoint_file = file;
+}
+
+void sim_t::set_fork_server(reg_t marker, const std::vector<fork_job_t>& jobs)
+{
+  fork_marker = marker;
+  fork_jobs = jobs;
+}
+
+// fork a child for each job, running as many at once as there are host
+// processors.  returns false in each child, which should go on to run its
+// job, and true in the parent once all the jobs are done.
+bool sim_t::serve_forks(int* exit_code)
+{
+  stop_workers();
+  fork_pending = false;
+  fork_marker = 0;
+  procs[fork_hart]->state.fromhost = 1; // let the hart past the marker
+
+  size_t max_children = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  std::map<pid_t, size_t> children;
+  size_t failures = 0;
+
+  for (size_t i = 0; i < fork_jobs.size() || !children.empty(); )
+  {
+    if (i < fork_jobs.size() && children.size() < max_children)
+    {
+      fflush(stdout);
+      fflush(stderr);
+      pid_t pid = fork();
+      if (pid == 0)
+      {
+        start_fork_job(fork_jobs[i]);
+        fork_jobs.clear();
+        return false;
+      }
+      if (pid < 0)
+      {
+        fprintf(stderr, "error: could not fork job %zu: %s\n", i, strerror(errno));
+        exit(-1);
+      }
+      children[pid] = i++;
+      continue;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0)
+      break;
+    auto it = children.find(pid);
+    if (it == children.end())
+      continue;
+
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    fprintf(stderr, "job %zu: exit code %d\n", it->second, code);
+    failures += code != 0;
+    children.erase(it);
+  }
+
+  fprintf(stderr, "%zu of %zu jobs failed\n", failures, fork_jobs.size());
+  *exit_code = failures != 0;
+  return true;
+}
+
+// turn a freshly forked child into a simulator running the given job.  the
+// front-end ran on a host thread that doesn't exist in the child, so a new
+// one is started, which resumes the harts rather than reloading them.
+void sim_t::start_fork_job(const fork_job_t& job)
+{
+  htif.release();
+  htif.reset(new htif_isasim_t(this, job.args.empty() ? htif_args : job.args, true));
+
+  for (size_t i = 0; i < job.patches.size(); i++)
+  {
+    try {
+      debug_mmu->store_uint64(job.patches[i].first, job.patches[i].second);
+    } catch (trap_t& t) {
+      fprintf(stderr, "error: could not patch memory at 0x%" PRIx64 "\n", job.patches[i].first);
+      exit(-1);
+    }
+  }
+
+  // the patches may have overwritten code the harts have decoded
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->flush_tlb();
+}
+
+// the HTIF's own state (its packet sequence number and the front-end's
+// open files) belongs to the current connection, so it isn't saved; the
+// tohost and fromhost registers are part of each hart's state.
+void sim_t::checkpoint(checkpoint_t& ckpt)
+{
+  ckpt.check(procs.size(), "number of processors");
+  ckpt.check(mems.size(), "number of memory regions");
+  for (size_t i = 0; i < mems.size(); i++)
+  {
+    ckpt.check(mems[i].first, "memory base");
+    ckpt.check(mems[i].second->size(), "memory size");
+  }
+
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->checkpoint(ckpt);
+  ckpt.transfer(current_step);
+  ckpt.transfer(current_proc);
+
+  for (size_t i = 0; i < mems.size(); i++)
+    mems[i].second->checkpoint(ckpt);
+
+  if (!ckpt.saving())
+    debug_mmu->flush_tlb();
+}
+
+void sim_t::request_htif(processor_t* p)
+{
+  htif_requested.store(true, std::memory_order_relaxed);
+  p->yield();
+}
+
+void sim_t::poll_htif()
+{
+  htif->tick();
+  schedule(HTIF_INTERVAL, [this]{ poll_htif(); });
+}
+
+void sim_t::run_events()
+{
+  if (htif_requested.exchange(false, std::memory_order_relaxed))
+    htif->tick();
+  events.run(now);
+}
+
 void sim_t::step(size_t n)
 {
   for (size_t i = 0, steps = 0; i < n; i += steps)
   {
+    run_events();
+
+    // the hart's turn ends early if an event falls due, or if it yields
     steps = std::min(n - i, INTERLEAVE - current_step);
+    steps = std::min<uint64_t>(steps, events.next() - now);
     procs[current_proc]->step(steps);
+    now += steps;
 
     current_step += steps;
-    if (current_step == INTERLEAVE)
+    if (current_step == INTERLEAVE || procs[current_proc]->yielded())
     {
       current_step = 0;
       procs[current_proc]->yield_load_reservation();
       if (++current_proc == procs.size())
         current_proc = 0;
+    }
+  }
+}
+
+// events run between rounds, so the harts only see them at the
+// granularity of a quantum
+void sim_t::step_parallel()
+{
+  run_events();
+
+  if (workers.empty())
+    for (size_t i = 1; i < nthreads; i++)
+      workers.push_back(std::thread(&sim_t::worker, this, i, round));
+
+  {
+    std::lock_guard<std::mutex> lock(workers_lock);
+    groups_pending = nthreads - 1;
+    round++;
+  }
+  round_begin.notify_all();
+
+  // the calling thread steps the first group itself
+  step_group(0);
 
-      htif->tick();
+  std::unique_lock<std::mutex> lock(workers_lock);
+  round_end.wait(lock, [&]{ return groups_pending == 0; });
+  now += quantum * procs.size();
+}
+
+void sim_t::step_group(size_t group)
+{
+  for (size_t i = group; i < procs.size(); i += nthreads)
+  {
+    procs[i]->step(quantum);
+    procs[i]->yield_load_reservation();
+  }
+}
+
+void sim_t::worker(size_t group, size_t last_round)
+{
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(workers_lock);
+      round_begin.wait(lock, [&]{ return workers_exit || round != last_round; });
+      if (workers_exit)
+        return;
+      last_round = round;
     }
+
+    step_group(group);
+
+    std::lock_guard<std::mutex> lock(workers_lock);
+    if (--groups_pending == 0)
+      round_end.notify_one();
   }
 }
 
+void sim_t::stop_workers()
+{
+  {
+    std::lock_guard<std::mutex> lock(workers_lock);
+    workers_exit = true;
+  }
+  round_begin.notify_all();
+  for (auto& t : workers)
+    t.join();
+  workers.clear();
+  workers_exit = false;
+}
+
 bool sim_t::running()
 {
   for (size_t i = 0; i < procs.size(); i++)
@@ -121,12 +440,88 @@ void sim_t::set_debug(bool value)
   debug = value;
 }
 
-void sim_t::set_histogram(bool value)
+void sim_t::set_threads(size_t n)
 {
+  stop_workers();
+  nthreads = std::max(std::min(n, procs.size()), size_t(1));
+}
+
+void sim_t::set_quantum(size_t n)
+{
+  quantum = std::max(n, size_t(1));
+}
+
+void sim_t::set_histogram(bool value, size_t period, const char* file)
+{
+#ifndef RISCV_ENABLE_HISTOGRAM
+  if (value)
+    fprintf(stderr, "warning: the histogram is unavailable unless configured with --enable-histogram\n");
+#endif
   histogram_enabled = value;
+  histogram_file = file;
   for (size_t i = 0; i < procs.size(); i++) {
-    procs[i]->set_histogram(histogram_enabled);
+    procs[i]->set_histogram(histogram_enabled, period);
+  }
+}
+
+void sim_t::write_histogram()
+{
+  FILE* f = fopen(histogram_file.c_str(), "wb");
+  if (f == NULL)
+  {
+    fprintf(stderr, "error: could not write histogram %s: %s\n",
+            histogram_file.c_str(), strerror(errno));
+    return;
   }
+
+  uint64_t header[] = {histogram_t::HISTOGRAM_MAGIC, histogram_t::HISTOGRAM_VERSION, procs.size()};
+  fwrite(header, sizeof(header), 1, f);
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->histogram.write(f, i, procs[i]->histogram_period);
+
+  if (fclose(f) != 0)
+    fprintf(stderr, "error: could not write histogram %s\n", histogram_file.c_str());
+}
+
+void sim_t::set_profiler(size_t period, const std::vector<std::string>& elfs, const char* file)
+{
+  profiler.reset(new profiler_t(procs.size(), period));
+  profile_file = file;
+
+  for (size_t i = 0; i < elfs.size(); i++)
+    if (!profiler->add_symbols(elfs[i].c_str()))
+      fprintf(stderr, "warning: could not read symbols from %s\n", elfs[i].c_str());
+  if (elfs.empty())
+    for (size_t i = 0; i < htif_args.size(); i++)
+      profiler->add_symbols(htif_args[i].c_str());
+
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_profiler(profiler.get());
+}
+
+void sim_t::set_trace(const char* file)
+{
+  trace.reset(new trace_t(file, procs.size()));
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_trace(trace->get_buffer(i));
+}
+
+void sim_t::set_jit(bool value, bool lockstep)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_jit(value, lockstep);
+}
+
+void sim_t::set_icache(size_t entries, size_t ways)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->set_icache(entries, ways);
+}
+
+void sim_t::set_tlb(size_t entries)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->set_tlb(entries);
 }
 
 void sim_t::set_procs_debug(bool value)
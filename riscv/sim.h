@@ -6,17 +6,41 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "processor.h"
+#include "events.h"
+#include "devices.h"
 #include "mmu.h"
+#include "profiler.h"
+#include "trace.h"
 
 class htif_isasim_t;
+class checkpoint_t;
+
+// a copy of the simulation started by the fork server: the arguments for
+// the front-end (the original ones if empty), and 64-bit values to patch
+// into memory before the copy resumes
+struct fork_job_t
+{
+  std::vector<std::string> args;
+  std::vector<std::pair<reg_t, uint64_t>> patches;
+};
 
 // this class encapsulates the processors and memory in a RISC-V machine.
 class sim_t
 {
 public:
-  sim_t(const char* isa, size_t _nprocs, size_t mem_mb,
-        const std::vector<std::string>& htif_args);
+  // mems lists the base address and size of each RAM region; if it is
+  // empty, there is one region at address 0.  guest memory is populated on
+  // first touch.  it may be backed by huge pages, and mem_file may name an
+  // image to map copy-on-write over the first region.
+  sim_t(const char* isa, size_t _nprocs,
+        const std::vector<std::pair<reg_t, size_t>>& mems,
+        const std::vector<std::string>& htif_args,
+        const char* mem_file = NULL, bool hugepages = false);
   ~sim_t();
 
   // run the simulation to completion
@@ -24,13 +48,53 @@ public:
   bool running();
   void stop();
   void set_debug(bool value);
-  void set_histogram(bool value);
+  // sample the PC every period instructions, and write the histogram to
+  // file at exit (see histogram.h)
+  void set_histogram(bool value, size_t period = 1, const char* file = "histogram.bin");
+  void set_jit(bool value, bool lockstep);
+  // sample call stacks every period instructions, resolving them against
+  // the symbols of the given ELF files (by default, every target argument
+  // that is an ELF file), and write them to file at exit
+  void set_profiler(size_t period, const std::vector<std::string>& elfs, const char* file);
+  // record every retired instruction in a binary trace file
+  void set_trace(const char* file);
+  void set_icache(size_t entries, size_t ways);
+  void set_tlb(size_t entries);
+  void set_stats(bool value) { stats = value; }
   void set_procs_debug(bool value);
+  void set_threads(size_t n);
+  void set_quantum(size_t n);
+
+  // save the machine's state once its harts have retired instret
+  // instructions in total, or replace the state with a saved one as soon
+  // as the front-end has loaded the program
+  void set_save_checkpoint(const char* file, reg_t instret);
+  void set_load_checkpoint(const char* file);
+
+  // run until a hart writes marker to tohost, then fork a copy of the
+  // simulator for each job, sharing memory copy-on-write.  run() returns
+  // 0 in the parent once every job has exited with 0.
+  void set_fork_server(reg_t marker, const std::vector<fork_job_t>& jobs);
   htif_isasim_t* get_htif() { return htif.get(); }
 
   // deliver an IPI to a specific processor
   void send_ipi(reg_t who);
 
+  // run action once the harts have been stepped delay more instructions,
+  // in total.  this may be called from a device's load or store on any
+  // hart's thread.  the event runs on the main thread between turns, or
+  // between rounds under --threads, and delay counts from the start of the
+  // current turn or round.
+  void schedule(uint64_t delay, const event_queue_t::action_t& action)
+  {
+    events.schedule(now + delay, action);
+  }
+
+  // have the HTIF serviced as soon as the hart's current instruction
+  // retires, ending its turn.  harts call this when they hand the host a
+  // request or wait for a reply, rather than the host being polled.
+  void request_htif(processor_t* p);
+
   // returns the number of processors in this simulator
   size_t num_cores() { return procs.size(); }
   processor_t* get_core(size_t i) { return procs.at(i); }
@@ -38,19 +102,96 @@ public:
   // read one of the system control registers
   reg_t get_scr(int which);
 
+  // map a device into the physical address space
+  void add_device(reg_t addr, abstract_device_t* dev, reg_t size = 1) { bus.add_device(addr, dev, size); }
+
+  // the host address of the RAM at a physical address, or NULL if the
+  // address isn't RAM
+  char* addr_to_mem(reg_t addr)
+  {
+    for (size_t i = 0; i < mems.size(); i++)
+      if (addr - mems[i].first < mems[i].second->size())
+        return mems[i].second->contents() + (addr - mems[i].first);
+    return NULL;
+  }
+
+  // the physical address of some host address within RAM
+  reg_t mem_to_addr(char* x);
+
+  // access a device other than RAM; returns false if nothing is mapped there
+  bool mmio_load(reg_t addr, size_t len, uint8_t* bytes) { return bus.load(addr, len, bytes); }
+  bool mmio_store(reg_t addr, size_t len, const uint8_t* bytes) { return bus.store(addr, len, bytes); }
+
 private:
   std::unique_ptr<htif_isasim_t> htif;
-  char* mem; // main memory
-  size_t memsz; // memory size in bytes
+  std::vector<std::string> htif_args;
+  std::vector<std::pair<reg_t, mem_t*>> mems; // RAM regions, by base address
+  bus_t bus; // RAM and devices, by base address
   mmu_t* debug_mmu;  // debug port into main memory
   std::vector<processor_t*> procs;
 
+  // load the program straight into RAM, mapping its pages from the file
+  // where possible, and start the harts at its entry point.  programs
+  // that aren't ELF files, or that don't fit in RAM, are left to the
+  // front-end.
+  void load_program();
+  template<class ehdr_t, class phdr_t>
+  bool load_elf(const char* elf, size_t size, int fd, reg_t* entry);
+  mem_t* find_mem(reg_t addr, size_t len, reg_t* offset);
+
   void step(size_t n); // step through simulation
   static const size_t INTERLEAVE = 5000;
+
+  // harts run uninterrupted until an event is due.  the front-end is
+  // serviced when a hart asks, and otherwise only every HTIF_INTERVAL
+  // instructions, for the sake of its console.
+  static const uint64_t HTIF_INTERVAL = 1000000;
+  event_queue_t events;
+  uint64_t now; // instructions the harts have been stepped, in total
+  std::atomic<bool> htif_requested;
+  void poll_htif();
+  void run_events();
+
   size_t current_step;
   size_t current_proc;
   bool debug;
   bool histogram_enabled; // provide a histogram of PCs
+  std::string histogram_file;
+  void write_histogram();
+  std::unique_ptr<profiler_t> profiler;
+  std::string profile_file;
+  std::unique_ptr<trace_t> trace;
+  bool stats; // report performance counters at exit
+  void print_counters(size_t core);
+
+  const char* save_checkpoint_file;
+  reg_t save_checkpoint_instret;
+  const char* load_checkpoint_file;
+  reg_t total_instret();
+  void checkpoint(checkpoint_t& ckpt);
+
+  reg_t fork_marker;
+  bool fork_pending; // a hart has reached the marker
+  size_t fork_hart;
+  std::vector<fork_job_t> fork_jobs;
+  bool serve_forks(int* exit_code);
+  void start_fork_job(const fork_job_t& job);
+
+  // parallel execution: each host thread steps a fixed group of harts for
+  // one quantum, then all threads synchronize so the HTIF can be serviced
+  void step_parallel(); // step every hart by one quantum
+  void step_group(size_t group);
+  void worker(size_t group, size_t last_round);
+  void stop_workers();
+  size_t nthreads;
+  size_t quantum;
+  std::vector<std::thread> workers;
+  std::mutex workers_lock;
+  std::condition_variable round_begin;
+  std::condition_variable round_end;
+  size_t round;
+  size_t groups_pending;
+  bool workers_exit;
 
   // presents a prompt for introspection into the simulation
   void interactive();
@@ -66,6 +207,7 @@ private:
   void interactive_mem(const std::string& cmd, const std::vector<std::string>& args);
   void interactive_str(const std::string& cmd, const std::vector<std::string>& args);
   void interactive_until(const std::string& cmd, const std::vector<std::string>& args);
+  void interactive_stats(const std::string& cmd, const std::vector<std::string>& args);
   reg_t get_reg(const std::vector<std::string>& args);
   reg_t get_freg(const std::vector<std::string>& args);
   reg_t get_mem(const std::vector<std::string>& args);
@@ -0,0 +1,119 @@
+// See LICENSE for license details.
+
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+trace_buffer_t::trace_buffer_t(uint16_t hart, size_t entries)
+  : ring(entries), mask(entries - 1), hart(hart), head(0), tail(0)
+{
+}
+
+void trace_buffer_t::mem(reg_t addr, size_t len, const void* bytes, bool store)
+{
+  trace_record_t* r = current();
+  r->flags |= store ? trace_record_t::MEM_STORE : trace_record_t::MEM_LOAD;
+  r->mem_addr = addr;
+  r->mem_size = len;
+  if (bytes)
+  {
+    r->flags |= trace_record_t::MEM_DATA;
+    r->mem_data = 0;
+    memcpy(&r->mem_data, bytes, std::min(len, sizeof(r->mem_data)));
+  }
+}
+
+std::string trace_t::quote(const std::string& s)
+{
+  std::string res = "'";
+  for (size_t i = 0; i < s.size(); i++)
+    res += s[i] == '\'' ? std::string("'\\''") : std::string(1, s[i]);
+  return res + "'";
+}
+
+static bool ends_with(const std::string& s, const char* suffix)
+{
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+std::string trace_t::compressor(const std::string& file, bool decompress)
+{
+  const char* tool = ends_with(file, ".zst") ? "zstd -q" :
+                     ends_with(file, ".lz4") ? "lz4 -q" :
+                     ends_with(file, ".gz") ? "gzip" : NULL;
+  if (!tool)
+    return "";
+  return std::string(tool) + (decompress ? " -dc < " : " -c > ") + quote(file);
+}
+
+trace_t::trace_t(const char* file, size_t nharts)
+  : file(file), done(false)
+{
+  std::string cmd = compressor(file, false);
+  piped = !cmd.empty();
+  f = piped ? popen(cmd.c_str(), "w") : fopen(file, "w");
+  if (f == NULL)
+  {
+    fprintf(stderr, "error: could not open trace %s: %s\n", file, strerror(errno));
+    exit(-1);
+  }
+
+  uint64_t header[] = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t), nharts};
+  fwrite(header, sizeof(header), 1, f);
+
+  for (size_t i = 0; i < nharts; i++)
+    buffers.push_back(new trace_buffer_t(i, BUFFER_ENTRIES));
+
+  writer = std::thread(&trace_t::write_loop, this);
+}
+
+trace_t::~trace_t()
+{
+  done = true;
+  writer.join();
+
+  for (size_t i = 0; i < buffers.size(); i++)
+    delete buffers[i];
+
+  if ((piped ? pclose(f) : fclose(f)) != 0)
+    fprintf(stderr, "error: could not write trace %s\n", file.c_str());
+}
+
+bool trace_t::drain(trace_buffer_t* b)
+{
+  size_t tail = b->tail.load(std::memory_order_relaxed);
+  size_t head = b->head.load(std::memory_order_acquire);
+  if (head == tail)
+    return false;
+
+  // write up to the end of the ring; the rest goes next time round
+  size_t begin = tail & b->mask;
+  size_t n = std::min(head - tail, b->ring.size() - begin);
+  if (fwrite(&b->ring[begin], sizeof(trace_record_t), n, f) != n)
+  {
+    fprintf(stderr, "error: could not write trace %s: %s\n", file.c_str(), strerror(errno));
+    exit(-1);
+  }
+  b->tail.store(tail + n, std::memory_order_release);
+  return true;
+}
+
+void trace_t::write_loop()
+{
+  while (true)
+  {
+    // check for shutdown before draining, so the last records get written
+    bool finishing = done;
+    bool busy = false;
+    for (size_t i = 0; i < buffers.size(); i++)
+      busy |= drain(buffers[i]);
+    if (finishing && !busy)
+      break;
+    if (!busy)
+      usleep(100);
+  }
+}
@@ -0,0 +1,123 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_TRACE_H
+#define _RISCV_TRACE_H
+
+#include "decode.h"
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// one retired instruction, or one trap.  records are fixed-size and
+// stored in host byte order.
+struct trace_record_t
+{
+  static const uint8_t RD_WRITE = 1;  // rd_data was written to rd
+  static const uint8_t RD_FP = 2;     // rd is an FP register
+  static const uint8_t MEM_LOAD = 4;  // mem_addr was read
+  static const uint8_t MEM_STORE = 8; // mem_addr was written
+  static const uint8_t MEM_DATA = 16; // mem_data holds the value moved
+  static const uint8_t TRAP = 32;     // the instruction trapped, or an
+                                      // interrupt was taken before it;
+                                      // rd_data holds the cause
+
+  uint64_t pc;
+  uint32_t insn;     // 0 if the fetch itself failed
+  uint16_t hart;
+  uint8_t priv;      // privilege mode the instruction ran in
+  uint8_t flags;
+  uint8_t rd;
+  uint8_t mem_size;  // bytes accessed at mem_addr
+  uint8_t pad[6];
+  uint64_t rd_data;
+  uint64_t mem_addr; // virtual address of the last data access
+  uint64_t mem_data;
+};
+
+// a hart's records, on their way to the file.  the hart fills the slot
+// returned by current() and commits it; the writer thread drains the ring
+// concurrently.  the hart only waits if the writer falls a whole ring
+// behind.
+class trace_buffer_t
+{
+ public:
+  trace_buffer_t(uint16_t hart, size_t entries);
+
+  trace_record_t* current() { return &ring[head.load(std::memory_order_relaxed) & mask]; }
+
+  // start a record for the instruction at pc
+  trace_record_t* begin(reg_t pc, reg_t priv)
+  {
+    trace_record_t* r = current();
+    r->pc = pc;
+    r->insn = 0;
+    r->hart = hart;
+    r->priv = priv;
+    r->flags = 0;
+    return r;
+  }
+
+  void commit()
+  {
+    size_t h = head.load(std::memory_order_relaxed) + 1;
+    while (unlikely(h - tail.load(std::memory_order_acquire) > mask))
+      std::this_thread::yield();
+    head.store(h, std::memory_order_release);
+  }
+
+  // record the data access of the current instruction.  bytes is NULL if
+  // the value isn't known, as for AMOs.
+  void mem(reg_t addr, size_t len, const void* bytes, bool store);
+
+ private:
+  std::vector<trace_record_t> ring;
+  size_t mask;
+  uint16_t hart;
+  std::atomic<size_t> head; // next record the hart fills
+  std::atomic<size_t> tail; // next record the writer writes
+
+  friend class trace_t;
+};
+
+// writes the harts' records to a file from a background thread.  each
+// hart's records appear in order, but those of different harts are only
+// interleaved in chunks, so readers should use the hart field.
+//
+// files ending in .zst, .lz4 or .gz are compressed by piping them through
+// the corresponding tool.  the file starts with a header of host-endian
+// 64-bit words: TRACE_MAGIC, the version, the size of a record, and the
+// number of harts.
+class trace_t
+{
+ public:
+  static const uint64_t TRACE_MAGIC = 0x435254454b495053; // "SPIKETRC"
+  static const uint64_t TRACE_VERSION = 1;
+  static const size_t BUFFER_ENTRIES = 1 << 16;
+
+  trace_t(const char* file, size_t nharts);
+  ~trace_t(); // drains the buffers and closes the file
+
+  trace_buffer_t* get_buffer(size_t hart) { return buffers[hart]; }
+
+  // the command that compresses (or with decompress, expands) a file,
+  // based on its name, or "" if it isn't compressed
+  static std::string compressor(const std::string& file, bool decompress);
+
+  // quote a file name for a shell command line, such as one run by popen
+  static std::string quote(const std::string& s);
+
+ private:
+  std::string file;
+  FILE* f;
+  bool piped;
+  std::vector<trace_buffer_t*> buffers;
+  std::atomic<bool> done;
+  std::thread writer;
+
+  void write_loop();
+  bool drain(trace_buffer_t* b);
+};
+
+#endif
@@ -0,0 +1,184 @@
+// See LICENSE for license details.
+
+// This program replays the memory accesses recorded by spike --cache-trace
+// through cache models, so many cache configurations can be evaluated
+// from one run of the simulator.  Each --ic and --dc model is simulated
+// independently, and if --l2 is given, each gets its own copy of the L2.
+// --ic-sweep and --dc-sweep cover a whole range of geometries in one pass.
+// With --coherent, the harts instead get private copies of the L1s, kept
+// coherent in front of one shared L2, as in spike itself.
+
+#include "cachesim.h"
+#include "trace.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fesvr/option_parser.h>
+
+static void help()
+{
+  fprintf(stderr, "usage: spike-cachesim [options] <access file>\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --ic=<S>:<W>:<B>   Simulate an instruction cache with S sets, W ways,\n");
+  fprintf(stderr, "                       and B-byte blocks (may be repeated)\n");
+  fprintf(stderr, "  --dc=<S>:<W>:<B>   Simulate a data cache (may be repeated)\n");
+  fprintf(stderr, "                       (append :lru, :plru, :fifo or :rrip to any\n");
+  fprintf(stderr, "                       configuration to choose its replacement policy)\n");
+  fprintf(stderr, "  --l2=<S>:<W>:<B>   Put a copy of this L2 cache behind each model\n");
+  fprintf(stderr, "  --ic-sweep=<S>:<W>:<B> Print the miss rates of LRU caches of every\n");
+  fprintf(stderr, "  --dc-sweep=<S>:<W>:<B>   power-of-2 geometry in ranges such as\n");
+  fprintf(stderr, "                       64-4096:1-16:64 (may be repeated)\n");
+  fprintf(stderr, "  --hart=<n>         Only replay the accesses of hart <n>\n");
+  fprintf(stderr, "  --coherent=<n>     Give each of n harts private, coherent copies of\n");
+  fprintf(stderr, "                       one --ic and one --dc, sharing the --l2\n");
+  fprintf(stderr, "  --stats=<file>     Write the statistics to <file>, as CSV if it ends\n");
+  fprintf(stderr, "                       in .csv and as JSON otherwise\n");
+  fprintf(stderr, "  --stats-interval=<n> Also snapshot them every <n> instructions\n");
+  fprintf(stderr, "  --attribution=<bytes> Count the misses of each PC, and of each aligned\n");
+  fprintf(stderr, "                       region of <bytes> bytes, in the statistics\n");
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<std::string> ics, dcs, ic_sweeps, dc_sweeps;
+  std::string l2_config;
+  long hart = -1;
+  size_t coherent = 0;
+  std::string stats_file;
+  uint64_t stats_interval = 0;
+  size_t attribution = 0;
+
+  option_parser_t parser;
+  parser.help(&help);
+  parser.option(0, "ic", 1, [&](const char* s){ics.push_back(s);});
+  parser.option(0, "dc", 1, [&](const char* s){dcs.push_back(s);});
+  parser.option(0, "ic-sweep", 1, [&](const char* s){ic_sweeps.push_back(s);});
+  parser.option(0, "dc-sweep", 1, [&](const char* s){dc_sweeps.push_back(s);});
+  parser.option(0, "l2", 1, [&](const char* s){l2_config = s;});
+  parser.option(0, "hart", 1, [&](const char* s){hart = atol(s);});
+  parser.option(0, "coherent", 1, [&](const char* s){coherent = atol(s);});
+  parser.option(0, "stats", 1, [&](const char* s){stats_file = s;});
+  parser.option(0, "stats-interval", 1, [&](const char* s){stats_interval = strtoull(s, NULL, 0);});
+  parser.option(0, "attribution", 1, [&](const char* s){attribution = strtoull(s, NULL, 0);});
+
+  auto argv1 = parser.parse(argv);
+  if (!*argv1 || argv1[1] ||
+      (ics.empty() && dcs.empty() && ic_sweeps.empty() && dc_sweeps.empty()))
+    help();
+  if (coherent && (ics.size() > 1 || dcs.size() > 1))
+    help();
+  const char* file = *argv1;
+
+  // models are named after their configuration, so their statistics can
+  // be told apart
+  std::vector<std::unique_ptr<cache_memtracer_t>> models;
+  std::vector<std::unique_ptr<cache_sim_t>> l2s;
+  std::unique_ptr<coherent_cache_sim_t> caches;
+  memtracer_list_t list;
+  if (coherent)
+    caches.reset(new coherent_cache_sim_t(coherent, ics.empty() ? "" : ics[0],
+                                          dcs.empty() ? "" : dcs[0], l2_config));
+  for (size_t i = 0; i < (coherent ? 0 : ics.size() + dcs.size()); i++)
+  {
+    bool fetch = i < ics.size();
+    std::string config = fetch ? ics[i] : dcs[i - ics.size()];
+    std::string name = (fetch ? "I$ " : "D$ ") + config;
+    if (fetch)
+      models.emplace_back(new icache_sim_t(config.c_str(), name.c_str()));
+    else
+      models.emplace_back(new dcache_sim_t(config.c_str(), name.c_str()));
+    if (!l2_config.empty())
+    {
+      l2s.emplace_back(cache_sim_t::construct(l2_config.c_str(), ("L2$ behind " + name).c_str()));
+      models.back()->set_miss_handler(l2s.back().get());
+    }
+    list.hook(models.back().get());
+  }
+
+  std::vector<cache_sim_t*> caches_simulated;
+  if (caches)
+    caches_simulated = caches->get_caches();
+  for (size_t i = 0; i < models.size(); i++)
+    caches_simulated.push_back(models[i]->get_cache());
+  for (size_t i = 0; i < l2s.size(); i++)
+    caches_simulated.push_back(l2s[i].get());
+  if (attribution)
+    for (size_t i = 0; i < caches_simulated.size(); i++)
+      caches_simulated[i]->set_attribution(attribution);
+
+  std::vector<std::unique_ptr<cache_sweep_t>> sweeps;
+  for (size_t i = 0; i < ic_sweeps.size() + dc_sweeps.size(); i++)
+  {
+    bool fetch = i < ic_sweeps.size();
+    std::string config = fetch ? ic_sweeps[i] : dc_sweeps[i - ic_sweeps.size()];
+    sweeps.emplace_back(new cache_sweep_t(config.c_str(), fetch ? "I$" : "D$", fetch));
+    list.hook(sweeps.back().get());
+  }
+
+  std::unique_ptr<cache_stats_writer_t> stats;
+  if (!stats_file.empty())
+  {
+    stats.reset(new cache_stats_writer_t(stats_file.c_str(), caches_simulated, stats_interval));
+    list.hook(stats.get());
+  }
+
+  std::string cmd = trace_t::compressor(file, true);
+  FILE* f = cmd.empty() ? fopen(file, "r") : popen(cmd.c_str(), "r");
+  if (f == NULL)
+  {
+    fprintf(stderr, "error: could not open %s: %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  uint64_t header[3];
+  if (fread(header, sizeof(header), 1, f) != 1 || header[0] != access_stream_t::ACCESS_MAGIC)
+  {
+    fprintf(stderr, "error: %s is not a memory access trace\n", file);
+    return 1;
+  }
+  if (header[1] != access_stream_t::ACCESS_VERSION || header[2] != sizeof(mem_access_t))
+  {
+    fprintf(stderr, "error: %s was written by a different version of spike\n", file);
+    return 1;
+  }
+
+  mem_access_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, sizeof(mem_access_t), sizeof(buf) / sizeof(buf[0]), f)) != 0)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      if (hart >= 0 && buf[i].hart != hart)
+        continue;
+      bool store = buf[i].type == mem_access_t::STORE, fetch = buf[i].type == mem_access_t::FETCH;
+      list.trace(buf[i].addr, buf[i].bytes, store, fetch, buf[i].pc);
+      if (caches)
+      {
+        if (buf[i].hart >= coherent)
+        {
+          fprintf(stderr, "error: %s has accesses from hart %u; --coherent needs at least %u harts\n",
+                  file, buf[i].hart, buf[i].hart + 1);
+          return 1;
+        }
+        caches->access(buf[i].hart, buf[i].addr, buf[i].bytes, store, fetch, buf[i].pc);
+      }
+    }
+  }
+
+  if ((cmd.empty() ? fclose(f) : pclose(f)) != 0)
+  {
+    fprintf(stderr, "error: could not read %s\n", file);
+    return 1;
+  }
+
+  // the statistics are written while the caches still exist, and the L1s
+  // print theirs before the L2s behind them
+  stats.reset();
+  models.clear();
+  return 0;
+}
@@ -0,0 +1,128 @@
+// See LICENSE for license details.
+
+// This program reads a binary trace written by spike --trace and prints
+// its records as text, one per line, optionally keeping only those of
+// one hart, a range of PCs, or traps.
+
+#include "trace.h"
+#include "disasm.h"
+#include "extension.h"
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fesvr/option_parser.h>
+
+static void help()
+{
+  fprintf(stderr, "usage: spike-trace [options] <trace file>\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --hart=<n>         Only print records of hart <n>\n");
+  fprintf(stderr, "  --pc=<lo>:<hi>     Only print records with lo <= pc < hi\n");
+  fprintf(stderr, "  --traps            Only print traps\n");
+  fprintf(stderr, "  --count            Print the number of matching records instead\n");
+  fprintf(stderr, "  --extension=<name> Disassemble the instructions of an extension\n");
+  exit(1);
+}
+
+static void print_record(const trace_record_t& r, disassembler_t& d)
+{
+  static const char* privs = "usHm";
+  bool more = r.flags & (trace_record_t::TRAP | trace_record_t::RD_WRITE |
+                         trace_record_t::MEM_LOAD | trace_record_t::MEM_STORE);
+  printf(more ? "core %3u: %c 0x%016" PRIx64 " (0x%08" PRIx32 ") %-30s" :
+                "core %3u: %c 0x%016" PRIx64 " (0x%08" PRIx32 ") %s",
+         r.hart, privs[r.priv & 3], r.pc, r.insn,
+         r.insn ? d.disassemble(r.insn).c_str() : "");
+  if (r.flags & trace_record_t::TRAP)
+    printf(" trap 0x%" PRIx64, r.rd_data);
+  if (r.flags & trace_record_t::RD_WRITE)
+    printf(" %c%-2u 0x%016" PRIx64, r.flags & trace_record_t::RD_FP ? 'f' : 'x',
+           r.rd, r.rd_data);
+  if (r.flags & (trace_record_t::MEM_LOAD | trace_record_t::MEM_STORE))
+  {
+    const char* kind = (r.flags & trace_record_t::MEM_LOAD) && (r.flags & trace_record_t::MEM_STORE) ? "amo" :
+                       r.flags & trace_record_t::MEM_STORE ? "store" : "load";
+    printf(" %s%u 0x%016" PRIx64, kind, r.mem_size, r.mem_addr);
+    if (r.flags & trace_record_t::MEM_DATA)
+      printf(" 0x%" PRIx64, r.mem_data);
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+  long hart = -1;
+  uint64_t pc_lo = 0, pc_hi = UINT64_MAX;
+  bool traps = false;
+  bool count = false;
+  std::function<extension_t*()> extension;
+
+  option_parser_t parser;
+  parser.help(&help);
+  parser.option(0, "hart", 1, [&](const char* s){hart = atol(s);});
+  parser.option(0, "pc", 1, [&](const char* s){
+    char* end;
+    pc_lo = strtoull(s, &end, 0);
+    if (*end != ':')
+      help();
+    pc_hi = strtoull(end + 1, NULL, 0);
+  });
+  parser.option(0, "traps", 0, [&](const char* s){traps = true;});
+  parser.option(0, "count", 0, [&](const char* s){count = true;});
+  parser.option(0, "extension", 1, [&](const char* s){extension = find_extension(s);});
+
+  auto argv1 = parser.parse(argv);
+  if (!*argv1 || argv1[1])
+    help();
+  const char* file = *argv1;
+
+  disassembler_t d;
+  if (extension)
+    for (auto disasm_insn : extension()->get_disasms())
+      d.add_insn(disasm_insn);
+
+  std::string cmd = trace_t::compressor(file, true);
+  FILE* f = cmd.empty() ? fopen(file, "r") : popen(cmd.c_str(), "r");
+  if (f == NULL)
+  {
+    fprintf(stderr, "error: could not open trace %s: %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  uint64_t header[4];
+  if (fread(header, sizeof(header), 1, f) != 1 || header[0] != trace_t::TRACE_MAGIC)
+  {
+    fprintf(stderr, "error: %s is not a trace\n", file);
+    return 1;
+  }
+  if (header[1] != trace_t::TRACE_VERSION || header[2] != sizeof(trace_record_t))
+  {
+    fprintf(stderr, "error: %s was written by a different version of spike\n", file);
+    return 1;
+  }
+
+  uint64_t matches = 0;
+  trace_record_t r;
+  while (fread(&r, sizeof(r), 1, f) == 1)
+  {
+    if ((hart >= 0 && r.hart != hart) || r.pc < pc_lo || r.pc >= pc_hi ||
+        (traps && !(r.flags & trace_record_t::TRAP)))
+      continue;
+    matches++;
+    if (!count)
+      print_record(r, d);
+  }
+
+  if (count)
+    printf("%" PRIu64 "\n", matches);
+
+  if ((cmd.empty() ? fclose(f) : pclose(f)) != 0)
+  {
+    fprintf(stderr, "error: could not read trace %s\n", file);
+    return 1;
+  }
+  return 0;
+}
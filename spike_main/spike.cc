@@ -1,6 +1,7 @@
 // See LICENSE for license details.
 
 #include "sim.h"
+#include "mmu.h"
 #include "htif.h"
 #include "cachesim.h"
 #include "extension.h"
@@ -8,38 +9,205 @@
 #include <fesvr/option_parser.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <memory>
+#include <fstream>
+#include <sstream>
 
 static void help()
 {
   fprintf(stderr, "usage: spike [host options] <target program> [target options]\n");
   fprintf(stderr, "Host Options:\n");
   fprintf(stderr, "  -p <n>             Simulate <n> processors [default 1]\n");
+  fprintf(stderr, "  --threads=<n>      Step processors on <n> host threads [default 1]\n");
+  fprintf(stderr, "  --quantum=<n>      Instructions per processor between host thread\n");
+  fprintf(stderr, "                       synchronizations [default 5000]\n");
   fprintf(stderr, "  -m <n>             Provide <n> MiB of target memory [default 4096]\n");
+  fprintf(stderr, "  -m <a:m,b:n,...>   Provide memory regions of size m and n bytes\n");
+  fprintf(stderr, "                       at base addresses a and b (page-aligned)\n");
+  fprintf(stderr, "  --mem-file=<file>  Map an image of target memory from <file>,\n");
+  fprintf(stderr, "                       copy-on-write, at address 0\n");
+  fprintf(stderr, "  --hugepages        Back target memory with huge pages\n");
   fprintf(stderr, "  -d                 Interactive debug mode\n");
   fprintf(stderr, "  -g                 Track histogram of PCs\n");
+  fprintf(stderr, "  --histogram-period=<n> Sample the PC every <n> instructions [default 1]\n");
+  fprintf(stderr, "  --histogram-file=<file> Write the histogram to <file>\n");
+  fprintf(stderr, "                       [default histogram.bin]\n");
+  fprintf(stderr, "  --profile=<n>      Sample guest call stacks every <n> instructions\n");
+  fprintf(stderr, "  --profile-elf=<file> Resolve samples against the symbols of <file>\n");
+  fprintf(stderr, "                       (may be repeated) [default: the target program]\n");
+  fprintf(stderr, "  --profile-file=<file> Write folded stacks to <file>\n");
+  fprintf(stderr, "                       [default profile.folded]\n");
+  fprintf(stderr, "  --trace=<file>     Write a binary trace of every retired instruction\n");
+  fprintf(stderr, "                       to <file>, compressed if it ends in .zst, .lz4\n");
+  fprintf(stderr, "                       or .gz; see spike-trace\n");
   fprintf(stderr, "  -h                 Print this help message\n");
+  fprintf(stderr, "  --icache-entries=<n> Cache <n> decoded instructions per processor\n");
+  fprintf(stderr, "                       (a power of 2) [default 4096]\n");
+  fprintf(stderr, "  --icache-ways=<n>  Associativity of the instruction cache, 1 or 2\n");
+  fprintf(stderr, "  --tlb-entries=<n>  Cache <n> translations per processor behind the\n");
+  fprintf(stderr, "                       main TLB (a power of 2, or 0) [default 4096]\n");
+  fprintf(stderr, "  --stats            Report performance counters at exit\n");
+  fprintf(stderr, "  --save-checkpoint=<file>@<n>  Save the machine's state to <file> once\n");
+  fprintf(stderr, "                       <n> instructions have been retired\n");
+  fprintf(stderr, "  --load-checkpoint=<file>  Start from the state saved in <file>; the\n");
+  fprintf(stderr, "                       same target program must be given\n");
+  fprintf(stderr, "  --fork-at=<value>  Once a hart writes <value> to tohost, run each\n");
+  fprintf(stderr, "  --fork-jobs=<file>   line of <file> in a forked copy of the simulator.\n");
+  fprintf(stderr, "                       A line lists memory patches, @<addr>=<value>,\n");
+  fprintf(stderr, "                       then the target program and its arguments\n");
+  fprintf(stderr, "  --jit              Translate hot code to host instructions\n");
+  fprintf(stderr, "  --jit-lockstep     Check translated code against the interpreter\n");
   fprintf(stderr, "  --isa=<name>       RISC-V ISA string [default RV64IMAFDC]\n");
   fprintf(stderr, "  --ic=<S>:<W>:<B>   Instantiate a cache model with S sets,\n");
   fprintf(stderr, "  --dc=<S>:<W>:<B>     W ways, and B-byte blocks (with S and\n");
-  fprintf(stderr, "  --l2=<S>:<W>:<B>     B both powers of 2).\n");
+  fprintf(stderr, "  --l2=<S>:<W>:<B>     B both powers of 2).  Append :lru, :plru, :fifo\n");
+  fprintf(stderr, "                       or :rrip to replace lines by that policy rather\n");
+  fprintf(stderr, "                       than at random.  Each hart gets private L1s,\n");
+  fprintf(stderr, "                       kept coherent, in front of a shared L2.  The\n");
+  fprintf(stderr, "                       models run on their own host thread\n");
+  fprintf(stderr, "  --ic-sweep=<S>:<W>:<B> Print the miss rates of LRU caches of every\n");
+  fprintf(stderr, "  --dc-sweep=<S>:<W>:<B>   power-of-2 geometry in ranges such as\n");
+  fprintf(stderr, "                       64-4096:1-16:64, simulated in one pass\n");
+  fprintf(stderr, "  --cache-stats=<file> Write the cache models' statistics to <file>, as\n");
+  fprintf(stderr, "                       CSV if it ends in .csv and as JSON otherwise\n");
+  fprintf(stderr, "  --cache-stats-interval=<n> Also snapshot them every <n> instructions\n");
+  fprintf(stderr, "  --cache-attribution=<bytes> Count the misses of each PC, and of each\n");
+  fprintf(stderr, "                       aligned region of <bytes> bytes, in the statistics\n");
+  fprintf(stderr, "  --cache-trace=<file> Record physical memory accesses to <file>, for\n");
+  fprintf(stderr, "                       replay with spike-cachesim\n");
   fprintf(stderr, "  --extension=<name> Specify RoCC Extension\n");
   fprintf(stderr, "  --extlib=<name>    Shared library to load\n");
   exit(1);
 }
 
+// parse -m: either a size in MiB at address 0, or a list of base:size
+// pairs in bytes.  a size of 0 leaves the default layout.
+static std::vector<std::pair<reg_t, size_t>> parse_mem_layout(const char* arg)
+{
+  std::vector<std::pair<reg_t, size_t>> res;
+  if (!strchr(arg, ':'))
+  {
+    if (size_t mb = atoi(arg))
+      res.push_back(std::make_pair(reg_t(0), mb << 20));
+    return res;
+  }
+
+  while (true)
+  {
+    char* p;
+    reg_t base = strtoull(arg, &p, 0);
+    if (p == arg || *p != ':')
+      help();
+    const char* sizestr = p + 1;
+    reg_t size = strtoull(sizestr, &p, 0);
+    if (p == sizestr || (*p != ',' && *p != '\0'))
+      help();
+
+    if ((base | size) % PGSIZE != 0 || size == 0)
+    {
+      fprintf(stderr, "error: memory regions must be page-aligned and nonempty\n");
+      exit(1);
+    }
+    res.push_back(std::make_pair(base, size_t(size)));
+
+    if (*p == '\0')
+      break;
+    arg = p + 1;
+  }
+
+  // the first region listed gets --mem-file, so only a copy is sorted
+  auto sorted = res;
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t i = 1; i < sorted.size(); i++)
+  {
+    if (sorted[i].first - sorted[i-1].first < sorted[i-1].second)
+    {
+      fprintf(stderr, "error: memory regions must not overlap\n");
+      exit(1);
+    }
+  }
+  return res;
+}
+
+// parse a file of fork server jobs, one per line
+static std::vector<fork_job_t> parse_fork_jobs(const char* file)
+{
+  std::ifstream in(file);
+  if (!in)
+  {
+    fprintf(stderr, "error: could not open fork jobs %s\n", file);
+    exit(1);
+  }
+
+  std::vector<fork_job_t> jobs;
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream words(line);
+    std::string word;
+    fork_job_t job;
+    while (words >> word)
+    {
+      if (word[0] != '@' || !job.args.empty())
+      {
+        job.args.push_back(word);
+        continue;
+      }
+
+      char* p;
+      reg_t addr = strtoull(word.c_str() + 1, &p, 0);
+      if (*p != '=')
+      {
+        fprintf(stderr, "error: bad memory patch %s in fork jobs %s\n", word.c_str(), file);
+        exit(1);
+      }
+      job.patches.push_back(std::make_pair(addr, (uint64_t)strtoull(p + 1, NULL, 0)));
+    }
+    if (!job.args.empty() || !job.patches.empty())
+      jobs.push_back(job);
+  }
+  return jobs;
+}
+
 int main(int argc, char** argv)
 {
   bool debug = false;
   bool histogram = false;
+  size_t histogram_period = 1;
+  const char* histogram_file = "histogram.bin";
+  size_t profile_period = 0;
+  std::vector<std::string> profile_elfs;
+  const char* profile_file = "profile.folded";
+  const char* trace_file = NULL;
+  bool jit = false;
+  size_t icache_entries = mmu_t::DEFAULT_ICACHE_ENTRIES;
+  size_t icache_ways = 1;
+  size_t tlb_entries = mmu_t::DEFAULT_TLB_L2_ENTRIES;
+  bool stats = false;
+  bool jit_lockstep = false;
   size_t nprocs = 1;
-  size_t mem_mb = 0;
-  std::unique_ptr<icache_sim_t> ic;
-  std::unique_ptr<dcache_sim_t> dc;
-  std::unique_ptr<cache_sim_t> l2;
+  size_t nthreads = 1;
+  size_t quantum = 0;
+  std::vector<std::pair<reg_t, size_t>> mems;
+  const char* mem_file = NULL;
+  bool hugepages = false;
+  std::string save_checkpoint;
+  reg_t save_checkpoint_instret = 0;
+  const char* load_checkpoint = NULL;
+  reg_t fork_marker = 0;
+  std::vector<fork_job_t> fork_jobs;
+  std::string ic, dc, l2;
+  std::unique_ptr<cache_sweep_t> ic_sweep;
+  std::unique_ptr<cache_sweep_t> dc_sweep;
+  const char* cache_trace = NULL;
+  const char* cache_stats_file = NULL;
+  uint64_t cache_stats_interval = 0;
+  size_t cache_attribution = 0;
   std::function<extension_t*()> extension;
   const char* isa = "RV64";
 
@@ -48,11 +216,43 @@ int main(int argc, char** argv)
   parser.option('h', 0, 0, [&](const char* s){help();});
   parser.option('d', 0, 0, [&](const char* s){debug = true;});
   parser.option('g', 0, 0, [&](const char* s){histogram = true;});
+  parser.option(0, "histogram-period", 1, [&](const char* s){histogram_period = atoi(s);});
+  parser.option(0, "histogram-file", 1, [&](const char* s){histogram_file = s;});
+  parser.option(0, "profile", 1, [&](const char* s){profile_period = atoi(s);});
+  parser.option(0, "profile-elf", 1, [&](const char* s){profile_elfs.push_back(s);});
+  parser.option(0, "profile-file", 1, [&](const char* s){profile_file = s;});
+  parser.option(0, "trace", 1, [&](const char* s){trace_file = s;});
   parser.option('p', 0, 1, [&](const char* s){nprocs = atoi(s);});
-  parser.option('m', 0, 1, [&](const char* s){mem_mb = atoi(s);});
-  parser.option(0, "ic", 1, [&](const char* s){ic.reset(new icache_sim_t(s));});
-  parser.option(0, "dc", 1, [&](const char* s){dc.reset(new dcache_sim_t(s));});
-  parser.option(0, "l2", 1, [&](const char* s){l2.reset(cache_sim_t::construct(s, "L2$"));});
+  parser.option('m', 0, 1, [&](const char* s){mems = parse_mem_layout(s);});
+  parser.option(0, "mem-file", 1, [&](const char* s){mem_file = s;});
+  parser.option(0, "hugepages", 0, [&](const char* s){hugepages = true;});
+  parser.option(0, "threads", 1, [&](const char* s){nthreads = atoi(s);});
+  parser.option(0, "quantum", 1, [&](const char* s){quantum = atoi(s);});
+  parser.option(0, "icache-entries", 1, [&](const char* s){icache_entries = atoi(s);});
+  parser.option(0, "icache-ways", 1, [&](const char* s){icache_ways = atoi(s);});
+  parser.option(0, "tlb-entries", 1, [&](const char* s){tlb_entries = atoi(s);});
+  parser.option(0, "stats", 0, [&](const char* s){stats = true;});
+  parser.option(0, "save-checkpoint", 1, [&](const char* s){
+    const char* at = strrchr(s, '@');
+    if (!at || at == s || !at[1])
+      help();
+    save_checkpoint = std::string(s, at);
+    save_checkpoint_instret = strtoull(at + 1, NULL, 0);
+  });
+  parser.option(0, "load-checkpoint", 1, [&](const char* s){load_checkpoint = s;});
+  parser.option(0, "fork-at", 1, [&](const char* s){fork_marker = strtoull(s, NULL, 0);});
+  parser.option(0, "fork-jobs", 1, [&](const char* s){fork_jobs = parse_fork_jobs(s);});
+  parser.option(0, "jit", 0, [&](const char* s){jit = true;});
+  parser.option(0, "jit-lockstep", 0, [&](const char* s){jit = jit_lockstep = true;});
+  parser.option(0, "ic", 1, [&](const char* s){ic = s;});
+  parser.option(0, "dc", 1, [&](const char* s){dc = s;});
+  parser.option(0, "l2", 1, [&](const char* s){l2 = s;});
+  parser.option(0, "ic-sweep", 1, [&](const char* s){ic_sweep.reset(new cache_sweep_t(s, "I$", true));});
+  parser.option(0, "dc-sweep", 1, [&](const char* s){dc_sweep.reset(new cache_sweep_t(s, "D$", false));});
+  parser.option(0, "cache-trace", 1, [&](const char* s){cache_trace = s;});
+  parser.option(0, "cache-stats", 1, [&](const char* s){cache_stats_file = s;});
+  parser.option(0, "cache-stats-interval", 1, [&](const char* s){cache_stats_interval = strtoull(s, NULL, 0);});
+  parser.option(0, "cache-attribution", 1, [&](const char* s){cache_attribution = strtoull(s, NULL, 0);});
   parser.option(0, "isa", 1, [&](const char* s){isa = s;});
   parser.option(0, "extension", 1, [&](const char* s){extension = find_extension(s);});
   parser.option(0, "extlib", 1, [&](const char *s){
@@ -67,18 +267,95 @@ int main(int argc, char** argv)
   if (!*argv1)
     help();
   std::vector<std::string> htif_args(argv1, (const char*const*)argv + argc);
-  sim_t s(isa, nprocs, mem_mb, htif_args);
 
-  if (ic && l2) ic->set_miss_handler(&*l2);
-  if (dc && l2) dc->set_miss_handler(&*l2);
+  if ((icache_ways != 1 && icache_ways != 2) || icache_entries < 8 ||
+      (icache_entries & (icache_entries - 1)))
+  {
+    fprintf(stderr, "error: --icache-entries must be a power of 2 (at least 8),\n"
+                    "       and --icache-ways must be 1 or 2\n");
+    exit(1);
+  }
+
+  if (tlb_entries & (tlb_entries - 1))
+  {
+    fprintf(stderr, "error: --tlb-entries must be a power of 2, or 0\n");
+    exit(1);
+  }
+
+  if (!fork_marker != fork_jobs.empty())
+  {
+    fprintf(stderr, "error: --fork-at and --fork-jobs must be given together\n");
+    exit(1);
+  }
+
+  // the threads consuming traces and cache accesses don't survive into
+  // forked jobs
+  if (fork_marker && (trace_file || !ic.empty() || !dc.empty() || ic_sweep || dc_sweep || cache_trace))
+  {
+    fprintf(stderr, "error: --trace, the cache models and --cache-trace can't be\n"
+                    "       used with the fork server\n");
+    exit(1);
+  }
+
+  // lockstep rolls guest RAM back between its two passes, which would
+  // clobber stores made meanwhile by harts on other threads
+  if (jit_lockstep && nthreads > 1)
+  {
+    fprintf(stderr, "error: --jit-lockstep can't be used with --threads\n");
+    exit(1);
+  }
+
+  if ((cache_stats_file || cache_attribution) && ic.empty() && dc.empty())
+  {
+    fprintf(stderr, "error: --cache-stats and --cache-attribution need --ic or --dc\n");
+    exit(1);
+  }
+
+  sim_t s(isa, nprocs, mems, htif_args, mem_file, hugepages);
+
+  // each hart gets its own L1s
+  std::unique_ptr<coherent_cache_sim_t> caches;
+  if (!ic.empty() || !dc.empty())
+    caches.reset(new coherent_cache_sim_t(nprocs, ic, dc, l2));
+  if (cache_attribution)
+    caches->set_attribution(cache_attribution);
+  std::vector<memtracer_t*> models;
+  if (ic_sweep) models.push_back(&*ic_sweep);
+  if (dc_sweep) models.push_back(&*dc_sweep);
+  std::unique_ptr<cache_stats_writer_t> cache_stats;
+  if (cache_stats_file)
+  {
+    cache_stats.reset(new cache_stats_writer_t(cache_stats_file, caches->get_caches(), cache_stats_interval));
+    models.push_back(&*cache_stats);
+  }
+  std::unique_ptr<access_stream_t> accesses;
+  if (caches || !models.empty() || cache_trace)
+    accesses.reset(new access_stream_t(nprocs, models, caches.get(), cache_trace));
+
   for (size_t i = 0; i < nprocs; i++)
   {
-    if (ic) s.get_core(i)->get_mmu()->register_memtracer(&*ic);
-    if (dc) s.get_core(i)->get_mmu()->register_memtracer(&*dc);
+    if (accesses) s.get_core(i)->get_mmu()->register_memtracer(accesses->get_buffer(i));
     if (extension) s.get_core(i)->register_extension(extension());
   }
 
+  s.set_icache(icache_entries, icache_ways);
+  s.set_tlb(tlb_entries);
+  s.set_stats(stats);
   s.set_debug(debug);
-  s.set_histogram(histogram);
+  s.set_histogram(histogram, histogram_period, histogram_file);
+  if (profile_period)
+    s.set_profiler(profile_period, profile_elfs, profile_file);
+  if (trace_file)
+    s.set_trace(trace_file);
+  s.set_jit(jit, jit_lockstep);
+  s.set_threads(nthreads);
+  if (!save_checkpoint.empty())
+    s.set_save_checkpoint(save_checkpoint.c_str(), save_checkpoint_instret);
+  if (load_checkpoint)
+    s.set_load_checkpoint(load_checkpoint);
+  if (fork_marker)
+    s.set_fork_server(fork_marker, fork_jobs);
+  if (quantum)
+    s.set_quantum(quantum);
   return s.run();
 }